@@ -0,0 +1,473 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "kafkacat.h"
+
+
+/**
+ * Chunked file messages.
+ *
+ * With -S the producer splits each file into chunks, each produced as
+ * a message with a framing header, and with -r the consumer writes the
+ * chunks back out as the original files.
+ *
+ * Chunk message layout, integers in network byte order:
+ *
+ *   0  magic        4   "KCCH"
+ *   4  version      1
+ *   5  reserved     1
+ *   6  name_len     2
+ *   8  file_id      8
+ *  16  file_size    8
+ *  24  idx          4   Chunk index, starting at 0
+ *  28  cnt          4   Total number of chunks in file
+ *  32  crc          4   CRC-32 of the chunk data
+ *  36  name         name_len   File path
+ *      data
+ */
+
+#define CHUNK_MAGIC    "KCCH"
+#define CHUNK_VERSION  1
+
+
+static uint32_t crc32_table[256];
+
+static void crc32_init (void) {
+        uint32_t i;
+
+        for (i = 0 ; i < 256 ; i++) {
+                uint32_t c = i;
+                int k;
+
+                for (k = 0 ; k < 8 ; k++)
+                        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                crc32_table[i] = c;
+        }
+}
+
+/**
+ * Returns the CRC-32 (IEEE 802.3) of 'len' bytes at 'buf'.
+ */
+static uint32_t chunk_crc32 (const void *buf, size_t len) {
+        const unsigned char *s = buf;
+        uint32_t c = 0xffffffff;
+
+        if (!crc32_table[1])
+                crc32_init();
+
+        while (len-- > 0)
+                c = crc32_table[(c ^ *s++) & 0xff] ^ (c >> 8);
+
+        return c ^ 0xffffffff;
+}
+
+
+static void put16 (char *p, uint16_t v) {
+        p[0] = v >> 8;
+        p[1] = v;
+}
+
+static void put32 (char *p, uint32_t v) {
+        put16(p, v >> 16);
+        put16(p+2, v);
+}
+
+static void put64 (char *p, uint64_t v) {
+        put32(p, v >> 32);
+        put32(p+4, v);
+}
+
+static uint16_t get16 (const char *p) {
+        const unsigned char *u = (const unsigned char *)p;
+        return (uint16_t)((u[0] << 8) | u[1]);
+}
+
+static uint32_t get32 (const char *p) {
+        return ((uint32_t)get16(p) << 16) | get16(p+2);
+}
+
+static uint64_t get64 (const char *p) {
+        return ((uint64_t)get32(p) << 32) | get32(p+4);
+}
+
+
+/**
+ * Returns a new file id for the file at 'path' of 'size' bytes,
+ * unique across producer runs with high probability.
+ */
+uint64_t chunk_file_id (const char *path, uint64_t size) {
+        static uint64_t seq;
+        uint64_t h = 14695981039346656037ULL; /* FNV-1a */
+        uint64_t v[4] = { size, (uint64_t)time(NULL),
+                          (uint64_t)getpid(), seq++ };
+        const unsigned char *s;
+        size_t i;
+
+        for (s = (const unsigned char *)path ; *s ; s++)
+                h = (h ^ *s) * 1099511628211ULL;
+
+        for (i = 0 ; i < sizeof(v) ; i++)
+                h = (h ^ ((const unsigned char *)v)[i]) * 1099511628211ULL;
+
+        return h;
+}
+
+
+/**
+ * Write chunk message for chunk 'ch' with 'len' bytes of data at 'data'
+ * to 'buf', which must have room for KC_CHUNK_HDR_SIZE + ch->name_len
+ * + len bytes.
+ * The data CRC is calculated and set in 'ch'.
+ *
+ * Returns the message length.
+ */
+size_t chunk_encode (char *buf, struct chunk_hdr *ch,
+                     const char *data, size_t len) {
+        char *p = buf;
+
+        ch->crc = chunk_crc32(data, len);
+
+        memcpy(p, CHUNK_MAGIC, 4);
+        p[4] = CHUNK_VERSION;
+        p[5] = 0;
+        put16(p+6, ch->name_len);
+        put64(p+8, ch->file_id);
+        put64(p+16, ch->file_size);
+        put32(p+24, ch->idx);
+        put32(p+28, ch->cnt);
+        put32(p+32, ch->crc);
+        p += KC_CHUNK_HDR_SIZE;
+
+        memcpy(p, ch->name, ch->name_len);
+        p += ch->name_len;
+
+        memcpy(p, data, len);
+        p += len;
+
+        return p - buf;
+}
+
+
+/**
+ * Parse chunk message of 'len' bytes at 'buf' into 'ch'.
+ * Returns 0 on success or -1 if the message is not a valid chunk.
+ */
+int chunk_decode (const char *buf, size_t len, struct chunk_hdr *ch) {
+        if (!buf || len < KC_CHUNK_HDR_SIZE ||
+            memcmp(buf, CHUNK_MAGIC, 4) || buf[4] != CHUNK_VERSION)
+                return -1;
+
+        ch->name_len  = get16(buf+6);
+        ch->file_id   = get64(buf+8);
+        ch->file_size = get64(buf+16);
+        ch->idx       = get32(buf+24);
+        ch->cnt       = get32(buf+28);
+        ch->crc       = get32(buf+32);
+
+        if (len < KC_CHUNK_HDR_SIZE + (size_t)ch->name_len ||
+            ch->idx >= ch->cnt)
+                return -1;
+
+        ch->name = buf + KC_CHUNK_HDR_SIZE;
+        ch->data = ch->name + ch->name_len;
+        ch->len  = len - KC_CHUNK_HDR_SIZE - ch->name_len;
+
+        return 0;
+}
+
+
+
+/**
+ * Consumer file reassembly (-r).
+ *
+ * Chunks of a file are on a single partition in order, so each file
+ * is written sequentially to a temporary file in the output directory
+ * as its chunks arrive, and renamed to its path, relative to the
+ * output directory, when complete.
+ * Only the files currently being received are kept open.
+ */
+
+struct reasm_file {
+        struct reasm_file *next;
+        uint64_t  file_id;
+        uint64_t  file_size;
+        uint64_t  written;
+        uint32_t  next_idx;
+        uint32_t  cnt;
+        int       fd;
+        char     *path;      /* Final path */
+        char     *tmppath;   /* Path while being written */
+};
+
+static struct {
+        const char        *dir;
+        struct reasm_file *files;
+} reasm;
+
+struct reasm_stats reasm_stats;
+
+
+void reasm_init (const char *dir) {
+        reasm.dir = dir;
+}
+
+
+static void reasm_file_destroy (struct reasm_file *rf, int complete) {
+        struct reasm_file **prevp;
+
+        for (prevp = &reasm.files ; *prevp != rf ; prevp = &(*prevp)->next)
+                ;
+        *prevp = rf->next;
+
+        if (rf->fd != -1)
+                close(rf->fd);
+
+        if (complete) {
+                if (rename(rf->tmppath, rf->path) == -1)
+                        INFO(1, "Failed to rename %s to %s: %s\n",
+                             rf->tmppath, rf->path, strerror(errno));
+        } else
+                unlink(rf->tmppath);
+
+        free(rf->path);
+        free(rf->tmppath);
+        free(rf);
+}
+
+
+/**
+ * Set up the output path ('rf->path') and temporary path ('rf->tmppath')
+ * in the reassembly directory for the file named 'name', creating any
+ * sub directories.
+ * Leading '/' and '.' path components are removed, and names with
+ * '..' components are replaced by the file id.
+ */
+static void reasm_paths (struct reasm_file *rf,
+                         const char *name, size_t name_len) {
+        char *rel = malloc(name_len + 32);
+        char *base;
+        size_t of = 0, i = 0;
+        size_t size;
+
+        while (i < name_len) {
+                size_t len;
+
+                while (i < name_len && name[i] == '/')
+                        i++;
+                for (len = 0 ; i + len < name_len && name[i+len] != '/' ;
+                     len++)
+                        ;
+
+                if ((len == 1 && name[i] == '.') || len == 0) {
+                        i += len;
+                        continue;
+                }
+
+                if ((len == 2 && !memcmp(name+i, "..", 2)) ||
+                    memchr(name+i, '\0', len)) {
+                        of = 0;
+                        break;
+                }
+
+                if (of > 0)
+                        rel[of++] = '/';
+                memcpy(rel+of, name+i, len);
+                of += len;
+                i  += len;
+        }
+
+        if (of == 0)
+                of = sprintf(rel, "file-%016"PRIx64, rf->file_id);
+        rel[of] = '\0';
+
+        /* Create sub directories */
+        for (i = 0 ; i < of ; i++) {
+                char *dir;
+
+                if (rel[i] != '/')
+                        continue;
+
+                size = strlen(reasm.dir) + 1 + i + 1;
+                dir = malloc(size);
+                snprintf(dir, size, "%s/%.*s", reasm.dir, (int)i, rel);
+                if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+                        FATAL("Failed to create directory %s: %s",
+                              dir, strerror(errno));
+                free(dir);
+        }
+
+        if ((base = strrchr(rel, '/')))
+                base++;
+        else
+                base = rel;
+
+        size = strlen(reasm.dir) + 1 + of + 1;
+        rf->path = malloc(size);
+        snprintf(rf->path, size, "%s/%s", reasm.dir, rel);
+
+        size += 1 + 18 + 5;
+        rf->tmppath = malloc(size);
+        snprintf(rf->tmppath, size, "%s/%.*s.%s.%016"PRIx64".part",
+                 reasm.dir, (int)(base - rel), rel, base, rf->file_id);
+
+        free(rel);
+}
+
+
+static struct reasm_file *reasm_file_new (const struct chunk_hdr *ch) {
+        struct reasm_file *rf;
+
+        rf = calloc(1, sizeof(*rf));
+        rf->file_id   = ch->file_id;
+        rf->file_size = ch->file_size;
+        rf->cnt       = ch->cnt;
+
+        reasm_paths(rf, ch->name, ch->name_len);
+
+        if ((rf->fd = open(rf->tmppath, O_WRONLY|O_CREAT|O_TRUNC,
+                           0644)) == -1)
+                FATAL("Failed to create %s: %s", rf->tmppath,
+                      strerror(errno));
+
+        rf->next = reasm.files;
+        reasm.files = rf;
+
+        return rf;
+}
+
+
+/**
+ * Write chunk message 'rkmessage' to its file.
+ */
+void reasm_msg (const rd_kafka_message_t *rkmessage) {
+        struct chunk_hdr ch;
+        struct reasm_file *rf;
+        const char *data;
+        size_t remain;
+
+        if (chunk_decode(rkmessage->payload, rkmessage->len, &ch) == -1) {
+                INFO(2, "Skipping non-chunk message at offset %"PRId64
+                     " in partition %"PRId32"\n",
+                     rkmessage->offset, rkmessage->partition);
+                reasm_stats.skipped++;
+                return;
+        }
+
+        for (rf = reasm.files ; rf ; rf = rf->next)
+                if (rf->file_id == ch.file_id)
+                        break;
+
+        if (!rf) {
+                if (ch.idx != 0) {
+                        /* Start of file not consumed, or file failed */
+                        reasm_stats.skipped++;
+                        return;
+                }
+                rf = reasm_file_new(&ch);
+        }
+
+        if (ch.idx < rf->next_idx) {
+                /* Duplicate */
+                reasm_stats.skipped++;
+                return;
+        }
+
+        if (ch.idx > rf->next_idx || ch.cnt != rf->cnt ||
+            chunk_crc32(ch.data, ch.len) != ch.crc) {
+                INFO(1, "Dropping file %s: chunk %"PRIu32"/%"PRIu32
+                     " at offset %"PRId64" in partition %"PRId32
+                     " is %s\n",
+                     rf->path, ch.idx, ch.cnt, rkmessage->offset,
+                     rkmessage->partition,
+                     ch.idx > rf->next_idx ? "out of sequence" :
+                     "corrupt");
+                reasm_stats.failed++;
+                reasm_file_destroy(rf, 0);
+                return;
+        }
+
+        for (data = ch.data, remain = ch.len ; remain > 0 ; ) {
+                ssize_t r = write(rf->fd, data, remain);
+                if (r == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        FATAL("Failed to write %s: %s",
+                              rf->tmppath, strerror(errno));
+                }
+                data   += r;
+                remain -= r;
+        }
+
+        rf->written += ch.len;
+        rf->next_idx++;
+        reasm_stats.chunks++;
+
+        if (rf->next_idx < rf->cnt)
+                return;
+
+        if (rf->written != rf->file_size) {
+                INFO(1, "Dropping file %s: size %"PRIu64" != %"PRIu64"\n",
+                     rf->path, rf->written, rf->file_size);
+                reasm_stats.failed++;
+                reasm_file_destroy(rf, 0);
+                return;
+        }
+
+        INFO(3, "Reassembled file %s (%"PRIu64" bytes)\n",
+             rf->path, rf->written);
+        reasm_stats.files++;
+        reasm_file_destroy(rf, 1);
+}
+
+
+/**
+ * Close files still being reassembled, which are left in their
+ * temporary files.
+ */
+void reasm_term (void) {
+        while (reasm.files) {
+                struct reasm_file *rf = reasm.files;
+
+                INFO(1, "Incomplete file %s: %"PRIu32"/%"PRIu32" chunks "
+                     "written to %s\n",
+                     rf->path, rf->next_idx, rf->cnt, rf->tmppath);
+                reasm_stats.incomplete++;
+
+                close(rf->fd);
+                rf->fd = -1;
+                reasm.files = rf->next;
+                free(rf->path);
+                free(rf->tmppath);
+                free(rf);
+        }
+}
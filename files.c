@@ -0,0 +1,372 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "kafkacat.h"
+
+
+/**
+ * Parallel file ingest for the producer's file mode.
+ *
+ * The file list is expanded by a thread, recursing into directories,
+ * while a pool of worker threads opens and maps the listed files ahead
+ * of the producer, asking the kernel to read them in, so that the
+ * producer does not stall on listing, opening and page faulting cold
+ * files.
+ * Files are handed to the producer in list order, and the workers
+ * run at most 'window' files ahead of it.
+ */
+
+
+/**
+ * Append 'path' to the file list and wake up the workers and producer.
+ */
+static void fileq_add (struct fileq *fq, char *path) {
+        pthread_mutex_lock(&fq->lock);
+
+        if (fq->cnt == fq->size) {
+                fq->size = fq->size ? fq->size * 2 : 256;
+                fq->files = realloc(fq->files,
+                                    sizeof(*fq->files) * fq->size);
+                if (!fq->files)
+                        FATAL("Failed to allocate file list of %i files",
+                              fq->size);
+        }
+
+        memset(&fq->files[fq->cnt], 0, sizeof(fq->files[fq->cnt]));
+        fq->files[fq->cnt++].path = path;
+
+        pthread_cond_broadcast(&fq->space_cond);
+
+        pthread_mutex_unlock(&fq->lock);
+}
+
+
+/**
+ * Add the regular files below directory 'path' to the file list,
+ * recursing into subdirectories.
+ * Directory entry types are used where the file system provides them,
+ * so that only entries of unknown type and symlinks need a stat().
+ * Symlinks to regular files are followed, symlinks to directories
+ * are not, and other file types are skipped.
+ */
+static void fileq_add_dir (struct fileq *fq, const char *path) {
+        DIR *dir;
+        struct dirent *d;
+
+        if (!(dir = opendir(path))) {
+                INFO(1, "Failed to open directory %s: %s\n",
+                     path, strerror(errno));
+                fq->stats.dir_errors++;
+                return;
+        }
+
+        while (!__atomic_load_n(&fq->term, __ATOMIC_RELAXED) &&
+               (d = readdir(dir))) {
+                char *sub;
+                size_t len;
+                int type = d->d_type;
+                struct stat st;
+
+                if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+                        continue;
+
+                len = strlen(path) + 1 + strlen(d->d_name) + 1;
+                sub = malloc(len);
+                snprintf(sub, len, "%s%s%s", path,
+                         path[strlen(path)-1] == '/' ? "" : "/", d->d_name);
+
+                if (type == DT_UNKNOWN) {
+                        if (lstat(sub, &st) == -1)
+                                type = DT_REG; /* Reported on open */
+                        else if (S_ISDIR(st.st_mode))
+                                type = DT_DIR;
+                        else if (S_ISLNK(st.st_mode))
+                                type = DT_LNK;
+                        else if (S_ISREG(st.st_mode))
+                                type = DT_REG;
+                }
+
+                if (type == DT_LNK)
+                        type = stat(sub, &st) == 0 && S_ISREG(st.st_mode) ?
+                                DT_REG : DT_UNKNOWN;
+
+                if (type == DT_DIR)
+                        fileq_add_dir(fq, sub);
+                else if (type == DT_REG) {
+                        fileq_add(fq, sub);
+                        continue;
+                } else
+                        INFO(3, "Skipping %s: not a regular file\n", sub);
+
+                free(sub);
+        }
+
+        closedir(dir);
+}
+
+
+/**
+ * Walk the paths given to fileq_new(), adding files to the list
+ * while the workers prepare the first ones.
+ */
+static void *fileq_walk_main (void *arg) {
+        struct fileq *fq = arg;
+        int i;
+
+        for (i = 0 ; i < fq->pathcnt &&
+                     !__atomic_load_n(&fq->term, __ATOMIC_RELAXED) ; i++) {
+                struct stat st;
+
+                /* Errors are reported when the file is opened */
+                if (lstat(fq->paths[i], &st) == 0 && S_ISDIR(st.st_mode))
+                        fileq_add_dir(fq, fq->paths[i]);
+                else
+                        fileq_add(fq, strdup(fq->paths[i]));
+        }
+
+        pthread_mutex_lock(&fq->lock);
+        fq->walking = 0;
+        pthread_cond_broadcast(&fq->space_cond);
+        pthread_cond_signal(&fq->ready_cond);
+        pthread_mutex_unlock(&fq->lock);
+
+        return NULL;
+}
+
+
+/**
+ * Open and map file 'f', and have the kernel start reading it in.
+ * Files that are not regular files, such as FIFOs or devices, are
+ * failed without reading: they are opened non-blocking so that a FIFO
+ * without a writer does not block the worker.
+ */
+static void fileq_prepare (struct kc_file *f) {
+        struct stat st;
+        int fd;
+
+        if ((fd = open(f->path, O_RDONLY|O_NONBLOCK)) == -1) {
+                f->err_op = "open";
+                f->err    = errno;
+                return;
+        }
+
+        if (fstat(fd, &st) == -1) {
+                f->err_op = "stat";
+                f->err    = errno;
+                close(fd);
+                return;
+        }
+
+        if (!S_ISREG(st.st_mode)) {
+                /* As mmap() would fail */
+                f->err_op = "mmap";
+                f->err    = ENODEV;
+                close(fd);
+                return;
+        }
+
+        if (st.st_size == 0) {
+                close(fd);
+                return;
+        }
+
+        f->ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (f->ptr == MAP_FAILED) {
+                f->ptr    = NULL;
+                f->err_op = "mmap";
+                f->err    = errno;
+                return;
+        }
+
+        f->size = st.st_size;
+
+        /* The file is read once from start to end */
+        madvise(f->ptr, f->size, MADV_WILLNEED);
+        madvise(f->ptr, f->size, MADV_SEQUENTIAL);
+}
+
+
+static void *fileq_worker_main (void *arg) {
+        struct fileq *fq = arg;
+
+        pthread_mutex_lock(&fq->lock);
+        while (1) {
+                struct kc_file f;
+                int i;
+
+                /* Wait for a file to be listed within the window */
+                while (!fq->term &&
+                       (fq->next < fq->cnt ?
+                        fq->next >= fq->consumed + fq->window :
+                        fq->walking))
+                        pthread_cond_wait(&fq->space_cond, &fq->lock);
+
+                if (fq->term || fq->next >= fq->cnt)
+                        break;
+
+                /* The list may be reallocated by the walk meanwhile */
+                i = fq->next++;
+                f = fq->files[i];
+                pthread_mutex_unlock(&fq->lock);
+
+                fileq_prepare(&f);
+
+                pthread_mutex_lock(&fq->lock);
+                fq->files[i] = f;
+                fq->files[i].ready = 1;
+                if (i == fq->consumed)
+                        pthread_cond_signal(&fq->ready_cond);
+        }
+        pthread_mutex_unlock(&fq->lock);
+
+        return NULL;
+}
+
+
+/**
+ * Create file queue for the 'pathcnt' files and directories in 'paths'
+ * with 'threads' worker threads.
+ */
+struct fileq *fileq_new (char **paths, int pathcnt, int threads) {
+        struct fileq *fq;
+        int i, r;
+
+        fq = calloc(1, sizeof(*fq));
+
+        fq->paths   = paths;
+        fq->pathcnt = pathcnt;
+        fq->walking = 1;
+        fq->window = threads * KC_FILEQ_WINDOW;
+        pthread_mutex_init(&fq->lock, NULL);
+        pthread_cond_init(&fq->ready_cond, NULL);
+        pthread_cond_init(&fq->space_cond, NULL);
+
+        if ((r = pthread_create(&fq->walk_thrd, NULL, fileq_walk_main, fq)))
+                FATAL("Failed to create file list thread: %s",
+                      strerror(r));
+
+        fq->thrds = malloc(sizeof(*fq->thrds) * threads);
+        for (i = 0 ; i < threads ; i++) {
+                if ((r = pthread_create(&fq->thrds[i], NULL,
+                                        fileq_worker_main, fq)))
+                        FATAL("Failed to create file reader thread: %s",
+                              strerror(r));
+                fq->thrd_cnt++;
+        }
+
+        return fq;
+}
+
+
+/**
+ * Get the next file, in list order, waiting for it to be prepared.
+ * The file must be released with fileq_release() before the
+ * next call.
+ *
+ * Returns 1 if a file was returned in 'f', or 0 at the end of the list.
+ */
+int fileq_next (struct fileq *fq, struct kc_file *f) {
+        pthread_mutex_lock(&fq->lock);
+        if (fq->consumed >= fq->cnt || !fq->files[fq->consumed].ready) {
+                fq->stats.waits++;
+                while (fq->consumed >= fq->cnt ? fq->walking :
+                       !fq->files[fq->consumed].ready)
+                        pthread_cond_wait(&fq->ready_cond, &fq->lock);
+        }
+
+        if (fq->consumed >= fq->cnt) {
+                /* The walk has finished */
+                pthread_mutex_unlock(&fq->lock);
+                return 0;
+        }
+
+        *f = fq->files[fq->consumed];
+        pthread_mutex_unlock(&fq->lock);
+
+        return 1;
+}
+
+
+/**
+ * Release file 'f' returned by fileq_next().
+ */
+void fileq_release (struct fileq *fq, struct kc_file *f) {
+        if (f->ptr)
+                munmap(f->ptr, f->size);
+
+        free(f->path);
+
+        pthread_mutex_lock(&fq->lock);
+        fq->files[fq->consumed].path = NULL;
+        fq->consumed++;
+        pthread_cond_broadcast(&fq->space_cond);
+        pthread_mutex_unlock(&fq->lock);
+}
+
+
+/**
+ * Stop the workers and release all remaining files.
+ * The queue's final stats are returned in 'stats'.
+ */
+void fileq_destroy (struct fileq *fq, struct fileq_stats *stats) {
+        int i;
+
+        pthread_mutex_lock(&fq->lock);
+        __atomic_store_n(&fq->term, 1, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&fq->space_cond);
+        pthread_mutex_unlock(&fq->lock);
+
+        pthread_join(fq->walk_thrd, NULL);
+        for (i = 0 ; i < fq->thrd_cnt ; i++)
+                pthread_join(fq->thrds[i], NULL);
+
+        fq->stats.files = fq->cnt;
+        *stats = fq->stats;
+
+        /* Files prepared ahead of the producer on termination */
+        for (i = fq->consumed ; i < fq->cnt ; i++) {
+                if (fq->files[i].ptr)
+                        munmap(fq->files[i].ptr, fq->files[i].size);
+                free(fq->files[i].path);
+        }
+
+        pthread_cond_destroy(&fq->ready_cond);
+        pthread_cond_destroy(&fq->space_cond);
+        pthread_mutex_destroy(&fq->lock);
+        free(fq->thrds);
+        free(fq->files);
+        free(fq);
+}
@@ -0,0 +1,278 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <regex.h>
+
+#include "kafkacat.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+
+/**
+ * Consumer message filter (-g, -G).
+ *
+ * Messages are matched against substrings and regular expressions
+ * before they are formatted, so that messages that are not output
+ * cost no formatting or output.
+ * A message matches if any pattern matches any of the fields
+ * selected with -F.
+ */
+
+struct filter {
+        char    *str;      /* Substring */
+        size_t   len;
+        int      regex;    /* Use 're' */
+        regex_t  re;
+};
+
+static struct filter *filters;
+static int filter_cnt;
+
+
+/**
+ * Returns a pointer to the first occurence of 'n' of length 'nlen' > 0
+ * in 's'..'end', or NULL if not found.
+ */
+static const char *substr_generic (const char *s, const char *end,
+                                   const char *n, size_t nlen) {
+        while ((size_t)(end - s) >= nlen &&
+               (s = memchr(s, n[0], (end - s) - nlen + 1))) {
+                if (!memcmp(s, n, nlen))
+                        return s;
+                s++;
+        }
+        return NULL;
+}
+
+/*
+ * The SIMD versions compare each position's first and last byte with
+ * those of the substring at once, comparing the whole substring only
+ * at positions where both match.
+ */
+
+#ifdef __SSE2__
+static const char *substr_sse2 (const char *s, const char *end,
+                                const char *n, size_t nlen) {
+        const __m128i first = _mm_set1_epi8(n[0]);
+        const __m128i last  = _mm_set1_epi8(n[nlen-1]);
+
+        while ((size_t)(end - s) >= 16 + nlen - 1) {
+                __m128i df = _mm_loadu_si128((const __m128i *)s);
+                __m128i dl = _mm_loadu_si128((const __m128i *)
+                                             (s + nlen - 1));
+                int m = _mm_movemask_epi8(
+                        _mm_and_si128(_mm_cmpeq_epi8(df, first),
+                                      _mm_cmpeq_epi8(dl, last)));
+                while (m) {
+                        int i = __builtin_ctz(m);
+                        if (!memcmp(s + i, n, nlen))
+                                return s + i;
+                        m &= m - 1;
+                }
+                s += 16;
+        }
+
+        return substr_generic(s, end, n, nlen);
+}
+#endif
+
+#if HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *substr_avx2 (const char *s, const char *end,
+                                const char *n, size_t nlen) {
+        const __m256i first = _mm256_set1_epi8(n[0]);
+        const __m256i last  = _mm256_set1_epi8(n[nlen-1]);
+
+        while ((size_t)(end - s) >= 32 + nlen - 1) {
+                __m256i df = _mm256_loadu_si256((const __m256i *)s);
+                __m256i dl = _mm256_loadu_si256((const __m256i *)
+                                                (s + nlen - 1));
+                unsigned int m = (unsigned int)_mm256_movemask_epi8(
+                        _mm256_and_si256(_mm256_cmpeq_epi8(df, first),
+                                         _mm256_cmpeq_epi8(dl, last)));
+                while (m) {
+                        int i = __builtin_ctz(m);
+                        if (!memcmp(s + i, n, nlen))
+                                return s + i;
+                        m &= m - 1;
+                }
+                s += 32;
+        }
+
+        return substr_generic(s, end, n, nlen);
+}
+#endif
+
+static const char *(*substr) (const char *s, const char *end,
+                              const char *n, size_t nlen) = substr_generic;
+
+
+/**
+ * Add filter pattern 'pattern', a substring or, if 'regex' is set,
+ * an extended regular expression.
+ */
+void filter_add (const char *pattern, int regex) {
+        struct filter *f;
+
+        filters = realloc(filters, sizeof(*filters) * (filter_cnt + 1));
+        f = &filters[filter_cnt];
+        memset(f, 0, sizeof(*f));
+
+        if (regex) {
+                int r;
+
+                if ((r = regcomp(&f->re, pattern,
+                                 REG_EXTENDED|REG_NOSUB))) {
+                        char errstr[256];
+                        regerror(r, &f->re, errstr, sizeof(errstr));
+                        FATAL("Invalid regular expression \"%s\": %s",
+                              pattern, errstr);
+                }
+                f->regex = 1;
+
+        } else {
+                if (!*pattern)
+                        FATAL("Empty filter substring");
+                f->str = strdup(pattern);
+                f->len = strlen(pattern);
+        }
+
+        filter_cnt++;
+}
+
+
+static int filter_match0 (const struct filter *f,
+                          const char *s, size_t len) {
+        if (f->regex) {
+#ifdef REG_STARTEND
+                regmatch_t pm = { .rm_so = 0, .rm_eo = len };
+
+                return !regexec(&f->re, s, 1, &pm, REG_STARTEND);
+#else
+                /* regexec() needs a nul-terminated copy */
+                static __thread char *buf;
+                static __thread size_t size;
+
+                if (len + 1 > size) {
+                        size = len + 1;
+                        buf = realloc(buf, size);
+                }
+                memcpy(buf, s, len);
+                buf[len] = '\0';
+
+                return !regexec(&f->re, buf, 0, NULL, 0);
+#endif
+        }
+
+        return len >= f->len && substr(s, s + len, f->str, f->len) != NULL;
+}
+
+static int filter_match_field (const char *s, size_t len) {
+        int i;
+
+        if (!s)
+                return 0;
+
+        for (i = 0 ; i < filter_cnt ; i++)
+                if (filter_match0(&filters[i], s, len))
+                        return 1;
+
+        return 0;
+}
+
+
+/**
+ * Returns 1 if 'rkmessage' passes the filter, or if there is none,
+ * else 0. The message is counted in 'stats'.
+ */
+int filter_match (const rd_kafka_message_t *rkmessage,
+                  struct filter_stats *stats) {
+        size_t bytes = 0;
+        int match = 0;
+
+        if (filter_cnt == 0)
+                return 1;
+
+        if (conf.filter_fields & KC_FILTER_KEY) {
+                match = filter_match_field(rkmessage->key,
+                                           rkmessage->key_len);
+                bytes += rkmessage->key_len;
+        }
+
+        if (conf.filter_fields & KC_FILTER_PAYLOAD) {
+                if (!match)
+                        match = filter_match_field(rkmessage->payload,
+                                                   rkmessage->len);
+                bytes += rkmessage->len;
+        }
+
+        if (conf.flags & CONF_F_FILTER_INVERT)
+                match = !match;
+
+        stats->msgs++;
+        stats->bytes += bytes;
+        if (match) {
+                stats->matched++;
+                stats->matched_bytes += bytes;
+        }
+
+        return match;
+}
+
+
+void filter_init (void) {
+        if (!conf.filter_fields)
+                conf.filter_fields = KC_FILTER_PAYLOAD;
+
+#ifdef __SSE2__
+        substr = substr_sse2;
+#endif
+#if HAVE_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                substr = substr_avx2;
+#endif
+}
+
+void filter_term (void) {
+        int i;
+
+        for (i = 0 ; i < filter_cnt ; i++) {
+                if (filters[i].regex)
+                        regfree(&filters[i].re);
+                free(filters[i].str);
+        }
+        free(filters);
+        filters = NULL;
+        filter_cnt = 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "kafkacat.h"
+
+
+/**
+ * Consumer formatting pipeline (-j).
+ *
+ * The consumer thread submits jobs, batches of consumed messages, to
+ * a pool of formatter threads which format each job into its own
+ * capture output. A single writer thread writes the formatted jobs
+ * in order and then hands them to the 'written_cb' callback.
+ *
+ * Each formatter thread has a FIFO of jobs, both those waiting to be
+ * formatted and those formatted and waiting to be written.
+ * In ordered mode jobs are submitted to the threads round-robin and
+ * written round-robin, thus in submission order.
+ * Otherwise the submitter picks the thread, e.g., by partition,
+ * and each thread's jobs are written in order but as soon as they are
+ * formatted, regardless of other threads' jobs.
+ */
+
+struct fmtq {
+        struct fmt_job *head, *tail;  /* Jobs in submission order */
+        struct fmt_job *next;         /* Next job to format */
+        pthread_cond_t  cond;         /* Job to format, or termination */
+        pthread_t       thrd;
+        struct fmtpipe *pipe;
+};
+
+struct fmtpipe {
+        pthread_mutex_t lock;
+        pthread_cond_t  done_cond;    /* Job formatted */
+        pthread_cond_t  space_cond;   /* Job written */
+        struct fmtq    *qs;
+        int             thread_cnt;
+        int             ordered;
+        int             submit_q;     /* Ordered: next thread to submit to */
+        int             write_q;      /* Ordered: next thread to write from */
+        int             job_cnt;      /* Jobs submitted but not written */
+        int             job_max;
+        int             term;
+        int             fd;
+        pthread_t       writer;
+        void          (*written_cb) (struct fmt_job *job, void *opaque);
+        void           *opaque;
+        struct fmtpipe_stats stats;
+};
+
+
+struct fmt_job *fmt_job_new (int size) {
+        struct fmt_job *job;
+
+        job = calloc(1, sizeof(*job));
+        job->msgs    = malloc(sizeof(*job->msgs) * size);
+        job->offsets = malloc(sizeof(*job->offsets) * size);
+
+        return job;
+}
+
+static void fmt_job_destroy (struct fmt_job *job) {
+        if (job->out)
+                output_destroy(job->out);
+        free(job->msgs);
+        free(job->offsets);
+        free(job);
+}
+
+
+static void *fmtpipe_formatter_main (void *arg) {
+        struct fmtq *q = arg;
+        struct fmtpipe *pipe = q->pipe;
+
+        pthread_mutex_lock(&pipe->lock);
+        while (1) {
+                struct fmt_job *job;
+                int i;
+
+                while (!q->next && !pipe->term)
+                        pthread_cond_wait(&q->cond, &pipe->lock);
+
+                if (!(job = q->next))
+                        break;
+
+                q->next = job->next;
+                pthread_mutex_unlock(&pipe->lock);
+
+                job->out = output_new_capture(pipe->fd);
+                for (i = 0 ; i < job->msg_cnt ; i++) {
+                        fmt_msg_output(job->out, job->msgs[i]);
+                        output_msg_done(job->out, job->msgs[i]);
+                }
+
+                pthread_mutex_lock(&pipe->lock);
+                job->done = 1;
+                pthread_cond_signal(&pipe->done_cond);
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        return NULL;
+}
+
+
+/**
+ * Returns the next formatted job to write, or NULL if there is none.
+ * Must be called with the lock held.
+ */
+static struct fmt_job *fmtpipe_next_done (struct fmtpipe *pipe) {
+        struct fmtq *q = NULL;
+        struct fmt_job *job;
+        int i;
+
+        if (pipe->ordered) {
+                if (pipe->qs[pipe->write_q].head &&
+                    pipe->qs[pipe->write_q].head->done) {
+                        q = &pipe->qs[pipe->write_q];
+                        pipe->write_q = (pipe->write_q + 1) %
+                                pipe->thread_cnt;
+                }
+        } else {
+                for (i = 0 ; i < pipe->thread_cnt ; i++) {
+                        if (pipe->qs[i].head && pipe->qs[i].head->done) {
+                                q = &pipe->qs[i];
+                                break;
+                        }
+                }
+        }
+
+        if (!q)
+                return NULL;
+
+        job = q->head;
+        if (!(q->head = job->next))
+                q->tail = NULL;
+
+        return job;
+}
+
+
+static void *fmtpipe_writer_main (void *arg) {
+        struct fmtpipe *pipe = arg;
+
+        pthread_mutex_lock(&pipe->lock);
+        while (1) {
+                struct fmt_job *job;
+
+                if (!(job = fmtpipe_next_done(pipe))) {
+                        if (pipe->term && pipe->job_cnt == 0)
+                                break;
+                        pipe->stats.writer_waits++;
+                        pthread_cond_wait(&pipe->done_cond, &pipe->lock);
+                        continue;
+                }
+
+                pthread_mutex_unlock(&pipe->lock);
+
+                output_flush(job->out);
+
+                pipe->stats.out.writes += job->out->stats.writes;
+                pipe->stats.out.bytes  += job->out->stats.bytes;
+                pipe->stats.out.copied += job->out->stats.copied;
+                pipe->stats.out.referenced += job->out->stats.referenced;
+
+                if (pipe->written_cb)
+                        pipe->written_cb(job, pipe->opaque);
+
+                fmt_job_destroy(job);
+
+                pthread_mutex_lock(&pipe->lock);
+                pipe->job_cnt--;
+                pthread_cond_signal(&pipe->space_cond);
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        return NULL;
+}
+
+
+/**
+ * Create pipeline with 'thread_cnt' formatter threads writing to 'fd'.
+ * 'written_cb' is called from the writer thread for each job once
+ * it has been written.
+ */
+struct fmtpipe *fmtpipe_new (int thread_cnt, int ordered, int fd,
+                             void (*written_cb) (struct fmt_job *job,
+                                                 void *opaque),
+                             void *opaque) {
+        struct fmtpipe *pipe;
+        int i, r;
+
+        pipe = calloc(1, sizeof(*pipe));
+        pipe->thread_cnt = thread_cnt;
+        pipe->ordered    = ordered;
+        pipe->job_max    = thread_cnt * KC_FMTPIPE_JOBS;
+        pipe->fd         = fd;
+        pipe->written_cb = written_cb;
+        pipe->opaque     = opaque;
+
+        pthread_mutex_init(&pipe->lock, NULL);
+        pthread_cond_init(&pipe->done_cond, NULL);
+        pthread_cond_init(&pipe->space_cond, NULL);
+
+        pipe->qs = calloc(thread_cnt, sizeof(*pipe->qs));
+        for (i = 0 ; i < thread_cnt ; i++) {
+                pipe->qs[i].pipe = pipe;
+                pthread_cond_init(&pipe->qs[i].cond, NULL);
+                if ((r = pthread_create(&pipe->qs[i].thrd, NULL,
+                                        fmtpipe_formatter_main,
+                                        &pipe->qs[i])))
+                        FATAL("Failed to create formatter thread: %s",
+                              strerror(r));
+        }
+
+        if ((r = pthread_create(&pipe->writer, NULL,
+                                fmtpipe_writer_main, pipe)))
+                FATAL("Failed to create writer thread: %s", strerror(r));
+
+        return pipe;
+}
+
+
+/**
+ * Submit 'job' to formatter thread 'thread' (ignored in ordered mode),
+ * waiting while the pipeline is full.
+ */
+void fmtpipe_submit (struct fmtpipe *pipe, struct fmt_job *job, int thread) {
+        struct fmtq *q;
+
+        pthread_mutex_lock(&pipe->lock);
+
+        if (pipe->job_cnt >= pipe->job_max) {
+                pipe->stats.submit_waits++;
+                while (pipe->job_cnt >= pipe->job_max)
+                        pthread_cond_wait(&pipe->space_cond, &pipe->lock);
+        }
+
+        if (pipe->ordered) {
+                thread = pipe->submit_q;
+                pipe->submit_q = (pipe->submit_q + 1) % pipe->thread_cnt;
+        }
+
+        q = &pipe->qs[thread];
+        if (q->tail)
+                q->tail->next = job;
+        else
+                q->head = job;
+        q->tail = job;
+
+        if (!q->next)
+                q->next = job;
+
+        pipe->job_cnt++;
+        pipe->stats.jobs++;
+
+        pthread_cond_signal(&q->cond);
+
+        pthread_mutex_unlock(&pipe->lock);
+}
+
+
+/**
+ * Write all submitted jobs, stop the threads and destroy the pipeline.
+ * The pipeline's statistics are returned in 'stats'.
+ */
+void fmtpipe_destroy (struct fmtpipe *pipe, struct fmtpipe_stats *stats) {
+        int i;
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->term = 1;
+        for (i = 0 ; i < pipe->thread_cnt ; i++)
+                pthread_cond_signal(&pipe->qs[i].cond);
+        pthread_cond_signal(&pipe->done_cond);
+        pthread_mutex_unlock(&pipe->lock);
+
+        for (i = 0 ; i < pipe->thread_cnt ; i++)
+                pthread_join(pipe->qs[i].thrd, NULL);
+        pthread_join(pipe->writer, NULL);
+
+        for (i = 0 ; i < pipe->thread_cnt ; i++)
+                pthread_cond_destroy(&pipe->qs[i].cond);
+        pthread_cond_destroy(&pipe->done_cond);
+        pthread_cond_destroy(&pipe->space_cond);
+        pthread_mutex_destroy(&pipe->lock);
+
+        *stats = pipe->stats;
+
+        free(pipe->qs);
+        free(pipe);
+}
@@ -93,6 +93,74 @@ static void fmt_add (fmt_type_t type, const char *str, int len) {
 }
 
 
+/**
+ * Merge adjacent literal strings in the formatter list.
+ */
+static void fmt_merge_str (void) {
+        int i, j = 0;
+
+        for (i = 0 ; i < conf.fmt_cnt ; i++) {
+                if (j > 0 &&
+                    conf.fmt[i].type == KC_FMT_STR &&
+                    conf.fmt[j-1].type == KC_FMT_STR) {
+                        int len = conf.fmt[j-1].str_len + conf.fmt[i].str_len;
+                        char *str = malloc(len + 1);
+
+                        memcpy(str, conf.fmt[j-1].str, conf.fmt[j-1].str_len);
+                        memcpy(str+conf.fmt[j-1].str_len,
+                               conf.fmt[i].str, conf.fmt[i].str_len);
+                        str[len] = '\0';
+
+                        free((char *)conf.fmt[j-1].str);
+                        free((char *)conf.fmt[i].str);
+                        conf.fmt[j-1].str     = str;
+                        conf.fmt[j-1].str_len = len;
+                        continue;
+                }
+
+                conf.fmt[j++] = conf.fmt[i];
+        }
+
+        conf.fmt_cnt = j;
+}
+
+
+static void fmt_msg_output_generic (struct output *out,
+                                    const rd_kafka_message_t *rkmessage);
+static void fmt_msg_output_payload (struct output *out,
+                                    const rd_kafka_message_t *rkmessage);
+static void fmt_msg_output_key_payload (struct output *out,
+                                        const rd_kafka_message_t *rkmessage);
+
+/* Output function for the parsed format */
+static void (*fmt_msg_output_str) (struct output *out,
+                                   const rd_kafka_message_t *rkmessage) =
+        fmt_msg_output_generic;
+
+
+/**
+ * Select the output function for the formatter list, with
+ * dedicated functions for the default formats:
+ *   %s<delim>  and  %k<key_delim>%s<delim>
+ */
+static void fmt_compile (void) {
+        fmt_merge_str();
+
+        if (conf.fmt_cnt == 2 &&
+            conf.fmt[0].type == KC_FMT_PAYLOAD &&
+            conf.fmt[1].type == KC_FMT_STR)
+                fmt_msg_output_str = fmt_msg_output_payload;
+        else if (conf.fmt_cnt == 4 &&
+                 conf.fmt[0].type == KC_FMT_KEY &&
+                 conf.fmt[1].type == KC_FMT_STR &&
+                 conf.fmt[2].type == KC_FMT_PAYLOAD &&
+                 conf.fmt[3].type == KC_FMT_STR)
+                fmt_msg_output_str = fmt_msg_output_key_payload;
+        else
+                fmt_msg_output_str = fmt_msg_output_generic;
+}
+
+
 /**
  * Parse a format string to create a formatter list.
  */
@@ -128,6 +196,17 @@ void fmt_parse (const char *fmt) {
                         case 'p':
                                 fmt_add(KC_FMT_PARTITION, NULL, 0);
                                 break;
+                        case '{':
+                                /* %{json:<path>} */
+                                if (strncmp(s+1, "json:", 5) ||
+                                    !(t = json_path_end(s+6, '}')))
+                                        FATAL("Unsupported formatter: %%%.*s",
+                                              (int)strcspn(s, "}")+1, s);
+                                fmt_add(KC_FMT_JSON, NULL, 0);
+                                conf.fmt[conf.fmt_cnt-1].json_path =
+                                        json_path_parse(s+6, t-(s+6));
+                                s = t;
+                                break;
                         case '%':
                                 fmt_add(KC_FMT_STR, s, 1);
                                 break;
@@ -145,12 +224,16 @@ void fmt_parse (const char *fmt) {
                 }
 
         }
+
+        fmt_compile();
 }
 
 
 
 
 void fmt_init (void) {
+        json_scan_init();
+
 #ifdef ENABLE_JSON
         if (conf.flags & CONF_F_FMT_JSON)
                 fmt_init_json();
@@ -158,6 +241,12 @@ void fmt_init (void) {
 }
 
 void fmt_term (void) {
+        int i;
+
+        for (i = 0 ; i < conf.fmt_cnt ; i++)
+                if (conf.fmt[i].json_path)
+                        json_path_destroy(conf.fmt[i].json_path);
+
 #ifdef ENABLE_JSON
         if (conf.flags & CONF_F_FMT_JSON)
                 fmt_term_json();
@@ -168,86 +257,200 @@ void fmt_term (void) {
 
 /**
  * Delimited output
+ *
+ * Keys and payloads are written by reference to the output,
+ * other fields are copied.
+ */
+
+static const char fmt_digits[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+/**
+ * Write the decimal representation of 'v'.
+ */
+void fmt_write_int (struct output *out, int64_t v) {
+        char tmp[24];
+        char *p = tmp + sizeof(tmp);
+        uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+        while (u >= 100) {
+                unsigned int i = (unsigned int)(u % 100) * 2;
+                u /= 100;
+                *--p = fmt_digits[i+1];
+                *--p = fmt_digits[i];
+        }
+
+        if (u >= 10) {
+                *--p = fmt_digits[u*2+1];
+                *--p = fmt_digits[u*2];
+        } else
+                *--p = (char)('0' + u);
+
+        if (v < 0)
+                *--p = '-';
+
+        output_write(out, p, tmp + sizeof(tmp) - p);
+}
+
+
+/**
+ * Returns the name of topic 'rkt', caching the last looked up topic
+ * per formatter thread.
+ */
+static const char *fmt_topic_name (rd_kafka_topic_t *rkt, size_t *lenp) {
+        static __thread rd_kafka_topic_t *cached_rkt;
+        static __thread const char *cached_name;
+        static __thread size_t cached_len;
+
+        if (rkt != cached_rkt) {
+                cached_name = rd_kafka_topic_name(rkt);
+                cached_len  = strlen(cached_name);
+                cached_rkt  = rkt;
+        }
+
+        *lenp = cached_len;
+        return cached_name;
+}
+
+
+static void fmt_write_key (struct output *out,
+                           const rd_kafka_message_t *rkmessage) {
+        if (rkmessage->key_len)
+                output_write_ref(out, rkmessage->key, rkmessage->key_len);
+        else if (conf.flags & CONF_F_NULL)
+                output_write(out, conf.null_str, conf.null_str_len);
+}
+
+static void fmt_write_payload (struct output *out,
+                               const rd_kafka_message_t *rkmessage) {
+        if (rkmessage->len)
+                output_write_ref(out, rkmessage->payload, rkmessage->len);
+        else if (conf.flags & CONF_F_NULL)
+                output_write(out, conf.null_str, conf.null_str_len);
+}
+
+/**
+ * Write the value at 'path' in the JSON payload, as JSON.
+ * Missing values are written like NULL payloads.
  */
-static void fmt_msg_output_str (FILE *fp,
-                                const rd_kafka_message_t *rkmessage) {
+static void fmt_write_json (struct output *out,
+                            const struct json_path *path,
+                            const rd_kafka_message_t *rkmessage) {
+        const char *payload = rkmessage->payload;
+        const char *start, *end;
+
+        if (!json_path_get(path, payload, payload + rkmessage->len,
+                           &start, &end)) {
+                if (conf.flags & CONF_F_NULL)
+                        output_write(out, conf.null_str, conf.null_str_len);
+                return;
+        }
+
+        /* Keep multi-line values on one line */
+        if (memchr(start, '\n', end - start) ||
+            memchr(start, '\r', end - start))
+                json_write_compact(out, start, end);
+        else
+                output_write_ref(out, start, end - start);
+}
+
+
+static void fmt_msg_output_generic (struct output *out,
+                                    const rd_kafka_message_t *rkmessage) {
+        const char *name;
+        size_t len;
         int i;
 
         for (i = 0 ; i < conf.fmt_cnt ; i++) {
-                int r = 1;
-
                 switch (conf.fmt[i].type)
                 {
                 case KC_FMT_OFFSET:
-                        r = fprintf(fp, "%"PRId64, rkmessage->offset);
+                        fmt_write_int(out, rkmessage->offset);
                         break;
 
                 case KC_FMT_KEY:
-                        if (rkmessage->key_len)
-                                r = fwrite(rkmessage->key,
-                                           rkmessage->key_len, 1, fp);
-                        else if (conf.flags & CONF_F_NULL)
-                                r = fwrite(conf.null_str,
-                                           conf.null_str_len, 1, fp);
-
+                        fmt_write_key(out, rkmessage);
                         break;
 
                 case KC_FMT_KEY_LEN:
-                        r = fprintf(fp, "%zd",
-                                    /* Use -1 to indicate NULL keys */
-                                    rkmessage->key ? rkmessage->key_len : -1);
+                        /* Use -1 to indicate NULL keys */
+                        fmt_write_int(out, rkmessage->key ?
+                                      (int64_t)rkmessage->key_len : -1);
                         break;
 
                 case KC_FMT_PAYLOAD:
-                        if (rkmessage->len)
-                                r = fwrite(rkmessage->payload,
-                                           rkmessage->len, 1, fp);
-                        else if (conf.flags & CONF_F_NULL)
-                                r = fwrite(conf.null_str,
-                                           conf.null_str_len, 1, fp);
+                        fmt_write_payload(out, rkmessage);
                         break;
 
                 case KC_FMT_PAYLOAD_LEN:
-                        r = fprintf(fp, "%zd",
-                                    /* Use -1 to indicate NULL messages */
-                                    rkmessage->payload ? rkmessage->len : -1);
+                        /* Use -1 to indicate NULL messages */
+                        fmt_write_int(out, rkmessage->payload ?
+                                      (int64_t)rkmessage->len : -1);
                         break;
 
                 case KC_FMT_STR:
-                        r = fwrite(conf.fmt[i].str, conf.fmt[i].str_len, 1, fp);
+                        output_write(out, conf.fmt[i].str,
+                                     conf.fmt[i].str_len);
                         break;
 
                 case KC_FMT_TOPIC:
-                        r = fprintf(fp, "%s",
-                                    rd_kafka_topic_name(rkmessage->rkt));
+                        name = fmt_topic_name(rkmessage->rkt, &len);
+                        output_write(out, name, len);
                         break;
 
                 case KC_FMT_PARTITION:
-                        r = fprintf(fp, "%"PRId32, rkmessage->partition);
+                        fmt_write_int(out, rkmessage->partition);
                         break;
 
+                case KC_FMT_JSON:
+                        fmt_write_json(out, conf.fmt[i].json_path, rkmessage);
+                        break;
                 }
-
-                if (r < 1)
-                        FATAL("Write error for message "
-                              "of %zd bytes at offset %"PRId64"): %s",
-                              rkmessage->len, rkmessage->offset,
-                              strerror(errno));
         }
+}
 
+
+/**
+ * Output for format "%s<delim>"
+ */
+static void fmt_msg_output_payload (struct output *out,
+                                    const rd_kafka_message_t *rkmessage) {
+        fmt_write_payload(out, rkmessage);
+        output_write(out, conf.fmt[1].str, conf.fmt[1].str_len);
+}
+
+
+/**
+ * Output for format "%k<key_delim>%s<delim>"
+ */
+static void fmt_msg_output_key_payload (struct output *out,
+                                        const rd_kafka_message_t *rkmessage) {
+        fmt_write_key(out, rkmessage);
+        output_write(out, conf.fmt[1].str, conf.fmt[1].str_len);
+        fmt_write_payload(out, rkmessage);
+        output_write(out, conf.fmt[3].str, conf.fmt[3].str_len);
 }
 
 
 /**
  * Format and output a received message.
  */
-void fmt_msg_output (FILE *fp, const rd_kafka_message_t *rkmessage) {
+void fmt_msg_output (struct output *out, const rd_kafka_message_t *rkmessage) {
 
 #ifdef ENABLE_JSON
         if (conf.flags & CONF_F_FMT_JSON)
-                fmt_msg_output_json(fp, rkmessage);
+                fmt_msg_output_json(out, rkmessage);
         else
 #endif
-                fmt_msg_output_str(fp, rkmessage);
+                fmt_msg_output_str(out, rkmessage);
 
 }
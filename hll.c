@@ -0,0 +1,475 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+
+#include "kafkacat.h"
+
+
+/**
+ * Consumer distinct key estimation (-a).
+ *
+ * The number of distinct keys is estimated per partition with a
+ * HyperLogLog sketch of KC_HLL_REGS registers: the top bits of the
+ * key's hash select a register, which keeps the highest position of
+ * the first set bit seen in the rest of the hash.
+ * Sketches are merged by taking each register's maximum, which gives
+ * the sketch of the union of the keys: the topic's sketch is that of
+ * its partitions, and sketches saved to a file (-A) by other runs or
+ * hosts can be merged into the partitions' sketches (-M).
+ *
+ * Each partition is consumed by a single instance, so the partitions'
+ * sketches need no locking.
+ */
+
+#define KC_HLL_RANK_MAX  (64 - KC_HLL_PRECISION + 1)
+
+struct hll hll;
+
+static char **hll_merge_paths;
+static int    hll_merge_cnt;
+
+
+/*
+ * Sketch file format, integers are little-endian:
+ *   "KCATHLL1"                  magic and version
+ *   u32 precision
+ *   u32 topic length, topic
+ *   u32 partition count, followed by that many partitions:
+ *     u32 partition
+ *     u64 messages
+ *     u64 NULL keys
+ *     u8  registers[1 << precision]
+ */
+static const char hll_magic[8] = "KCATHLL1";
+
+
+/**
+ * Add sketch file 'path' to be merged by hll_init() (-M).
+ */
+void hll_merge_add (const char *path) {
+        hll_merge_paths = realloc(hll_merge_paths,
+                                  sizeof(*hll_merge_paths) *
+                                  (hll_merge_cnt + 1));
+        hll_merge_paths[hll_merge_cnt++] = strdup(path);
+}
+
+
+static void hll_part_alloc (struct hll_part *hp) {
+        if (hp->present)
+                return;
+
+        if (posix_memalign((void **)&hp->regs, 64, KC_HLL_REGS))
+                FATAL("Failed to allocate key sketch");
+        memset(hp->regs, 0, KC_HLL_REGS);
+        hp->present = 1;
+}
+
+/**
+ * Merge the sketch of registers 'regs' into 'dst'.
+ */
+static void hll_part_merge (struct hll_part *dst, const uint8_t *regs,
+                            uint64_t msgs, uint64_t null_keys) {
+        int i;
+
+        hll_part_alloc(dst);
+
+        for (i = 0 ; i < KC_HLL_REGS ; i++)
+                if (regs[i] > dst->regs[i])
+                        dst->regs[i] = regs[i];
+
+        dst->msgs      += msgs;
+        dst->null_keys += null_keys;
+}
+
+
+/*
+ * Sketch file reading, failing on truncated files.
+ */
+struct hll_reader {
+        const char    *path;
+        const uint8_t *p;
+        const uint8_t *end;
+};
+
+static const uint8_t *hll_read (struct hll_reader *rd, size_t len) {
+        const uint8_t *p = rd->p;
+
+        if ((size_t)(rd->end - rd->p) < len)
+                FATAL("Key sketch file %s is truncated", rd->path);
+
+        rd->p += len;
+        return p;
+}
+
+static uint64_t hll_read_int (struct hll_reader *rd, int size) {
+        const uint8_t *p = hll_read(rd, size);
+        uint64_t v = 0;
+        int i;
+
+        for (i = 0 ; i < size ; i++)
+                v |= (uint64_t)p[i] << (i * 8);
+
+        return v;
+}
+
+
+/**
+ * Merge the sketches in file 'path' into the partitions' sketches.
+ */
+static void hll_merge_file (const char *path) {
+        struct hll_reader rd = { .path = path };
+        uint8_t *buf;
+        FILE *fp;
+        long size;
+        uint32_t len, cnt, i;
+
+        if (!(fp = fopen(path, "rb")))
+                FATAL("Failed to open key sketch file %s: %s",
+                      path, strerror(errno));
+
+        if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) == -1 ||
+            fseek(fp, 0, SEEK_SET) == -1)
+                FATAL("Failed to read key sketch file %s: %s",
+                      path, strerror(errno));
+
+        buf = malloc(size > 0 ? size : 1);
+        if (size > 0 && fread(buf, size, 1, fp) != 1)
+                FATAL("Failed to read key sketch file %s: %s",
+                      path, strerror(errno));
+        fclose(fp);
+
+        rd.p   = buf;
+        rd.end = buf + size;
+
+        if (memcmp(hll_read(&rd, sizeof(hll_magic)), hll_magic,
+                   sizeof(hll_magic)))
+                FATAL("%s is not a key sketch file", path);
+
+        if (hll_read_int(&rd, 4) != KC_HLL_PRECISION)
+                FATAL("Key sketch file %s has a different precision",
+                      path);
+
+        len = (uint32_t)hll_read_int(&rd, 4);
+        if (len != strlen(conf.topic) ||
+            memcmp(hll_read(&rd, len), conf.topic, len))
+                FATAL("Key sketch file %s is not for topic %s",
+                      path, conf.topic);
+
+        cnt = (uint32_t)hll_read_int(&rd, 4);
+        for (i = 0 ; i < cnt ; i++) {
+                uint32_t partition = (uint32_t)hll_read_int(&rd, 4);
+                uint64_t msgs      = hll_read_int(&rd, 8);
+                uint64_t null_keys = hll_read_int(&rd, 8);
+                const uint8_t *regs = hll_read(&rd, KC_HLL_REGS);
+                int r;
+
+                if (partition >= (uint32_t)hll.part_cnt)
+                        FATAL("Key sketch file %s has partition %"PRIu32
+                              ", topic %s has %i partitions",
+                              path, partition, conf.topic, hll.part_cnt);
+
+                for (r = 0 ; r < KC_HLL_REGS ; r++)
+                        if (regs[r] > KC_HLL_RANK_MAX)
+                                FATAL("Key sketch file %s is corrupt",
+                                      path);
+
+                hll_part_merge(&hll.parts[partition], regs,
+                               msgs, null_keys);
+        }
+
+        if (rd.p != rd.end)
+                FATAL("Key sketch file %s has trailing garbage", path);
+
+        free(buf);
+
+        INFO(1, "Merged %"PRIu32" partition key sketches from %s\n",
+             cnt, path);
+}
+
+
+/**
+ * Set up key sketches for the topic's 'part_cnt' partitions, of
+ * which the 'cnt' partitions in 'partitions' are consumed, and merge
+ * the sketch files added with hll_merge_add().
+ */
+void hll_init (int part_cnt, const int32_t *partitions, int cnt) {
+        int i;
+
+        hll.parts    = calloc(part_cnt, sizeof(*hll.parts));
+        hll.part_cnt = part_cnt;
+
+        for (i = 0 ; i < part_cnt ; i++)
+                hll.parts[i].partition = i;
+
+        for (i = 0 ; i < cnt ; i++)
+                hll_part_alloc(&hll.parts[partitions[i]]);
+
+        for (i = 0 ; i < hll_merge_cnt ; i++)
+                hll_merge_file(hll_merge_paths[i]);
+}
+
+
+/**
+ * Add consumed message 'rkmessage''s key to its partition's sketch.
+ */
+void hll_msg (const rd_kafka_message_t *rkmessage) {
+        struct hll_part *hp = &hll.parts[rkmessage->partition];
+        uint64_t h;
+        int rank;
+        uint32_t r;
+
+        hp->msgs++;
+
+        if (!rkmessage->key) {
+                hp->null_keys++;
+                return;
+        }
+
+        h = kc_hash64(rkmessage->key, rkmessage->key_len);
+
+        /* The top bits select the register, the rank is the position
+         * of the first set bit in the remaining bits. The sentinel bit
+         * limits the rank to KC_HLL_RANK_MAX. */
+        r = (uint32_t)(h >> (64 - KC_HLL_PRECISION));
+        rank = __builtin_clzll((h << KC_HLL_PRECISION) |
+                               (UINT64_C(1) << (KC_HLL_PRECISION - 1))) + 1;
+
+        if (rank > hp->regs[r])
+                hp->regs[r] = (uint8_t)rank;
+}
+
+
+/*
+ * Cardinality estimation from the register value histogram, with
+ * Ertl's improved estimator ("New cardinality estimation algorithms
+ * for HyperLogLog sketches", 2017), which unlike the original
+ * estimator needs no bias correction for small and large cardinalities.
+ */
+static double hll_sigma (double x) {
+        double y = 1.0, z = x, zp;
+
+        do {
+                x *= x;
+                zp = z;
+                z += x * y;
+                y += y;
+        } while (z > zp);
+
+        return z;
+}
+
+static double hll_tau (double x) {
+        double y = 1.0, z, zp;
+
+        if (x <= 0.0 || x >= 1.0)
+                return 0.0;
+
+        z = 1.0 - x;
+        do {
+                x = sqrt(x);
+                zp = z;
+                y *= 0.5;
+                z -= (1.0 - x) * (1.0 - x) * y;
+        } while (z < zp);
+
+        return z / 3.0;
+}
+
+static uint64_t hll_estimate (const uint8_t *regs) {
+        const double m = KC_HLL_REGS;
+        uint32_t c[KC_HLL_RANK_MAX + 1] = { 0 };
+        double z;
+        int i;
+
+        for (i = 0 ; i < KC_HLL_REGS ; i++)
+                c[regs[i]]++;
+
+        if (c[0] == KC_HLL_REGS)
+                return 0;
+
+        z = m * hll_tau(1.0 - c[KC_HLL_RANK_MAX] / m);
+        for (i = KC_HLL_RANK_MAX - 1 ; i >= 1 ; i--)
+                z = 0.5 * (z + c[i]);
+        z += m * hll_sigma(c[0] / m);
+
+        /* alpha_inf * m^2 / z, alpha_inf = 1 / (2 ln 2) */
+        return (uint64_t)llround(m * m / (2.0 * M_LN2 * z));
+}
+
+
+/**
+ * Estimate the partitions' distinct keys and merge their sketches
+ * into hll.total.
+ */
+static void hll_sum (void) {
+        struct hll_part *t = &hll.total;
+        int i;
+
+        free(t->regs);
+        memset(t, 0, sizeof(*t));
+        t->partition = -1;
+        hll_part_alloc(t);
+
+        for (i = 0 ; i < hll.part_cnt ; i++) {
+                struct hll_part *hp = &hll.parts[i];
+
+                if (!hp->present)
+                        continue;
+
+                hp->distinct = hll_estimate(hp->regs);
+                hll_part_merge(t, hp->regs, hp->msgs, hp->null_keys);
+        }
+
+        t->distinct = hll_estimate(t->regs);
+}
+
+
+static void hll_print_row (FILE *fp, const char *name,
+                           const struct hll_part *hp) {
+        fprintf(fp, "%-10s %12"PRIu64" %12"PRIu64" %14"PRIu64"\n",
+                name, hp->msgs, hp->null_keys, hp->distinct);
+}
+
+/**
+ * Print the distinct key table to 'fp'.
+ */
+static void hll_print_table (FILE *fp) {
+        int i;
+
+        fprintf(fp, "# Distinct keys, estimated with a standard error "
+                "of %.2f%%\n", 100.0 * KC_HLL_STDERR);
+        fprintf(fp, "%-10s %12s %12s %14s\n",
+                "Partition", "Messages", "NULL keys", "Distinct keys");
+
+        for (i = 0 ; i < hll.part_cnt ; i++) {
+                char name[16];
+
+                if (!hll.parts[i].present)
+                        continue;
+
+                snprintf(name, sizeof(name), "%i", i);
+                hll_print_row(fp, name, &hll.parts[i]);
+        }
+
+        hll_print_row(fp, "Total", &hll.total);
+}
+
+
+/**
+ * Print the distinct key estimates to 'fp', as JSON with -J.
+ */
+void hll_print (FILE *fp) {
+        hll_sum();
+
+#if ENABLE_JSON
+        if (conf.flags & CONF_F_FMT_JSON)
+                hll_print_json(fp);
+        else
+#endif
+                hll_print_table(fp);
+
+        fflush(fp);
+}
+
+
+static void hll_write (FILE *fp, const void *buf, size_t len) {
+        if (len > 0 && fwrite(buf, len, 1, fp) != 1)
+                FATAL("Failed to write key sketch file: %s",
+                      strerror(errno));
+}
+
+static void hll_write_int (FILE *fp, uint64_t v, int size) {
+        uint8_t buf[8];
+        int i;
+
+        for (i = 0 ; i < size ; i++)
+                buf[i] = (uint8_t)(v >> (i * 8));
+
+        hll_write(fp, buf, size);
+}
+
+
+/**
+ * Save the partitions' sketches to 'path' (-A), to be merged with -M.
+ */
+void hll_save (const char *path) {
+        FILE *fp;
+        uint32_t cnt = 0;
+        int i;
+
+        if (!(fp = fopen(path, "wb")))
+                FATAL("Failed to open key sketch file %s: %s",
+                      path, strerror(errno));
+
+        for (i = 0 ; i < hll.part_cnt ; i++)
+                if (hll.parts[i].present)
+                        cnt++;
+
+        hll_write(fp, hll_magic, sizeof(hll_magic));
+        hll_write_int(fp, KC_HLL_PRECISION, 4);
+        hll_write_int(fp, strlen(conf.topic), 4);
+        hll_write(fp, conf.topic, strlen(conf.topic));
+        hll_write_int(fp, cnt, 4);
+
+        for (i = 0 ; i < hll.part_cnt ; i++) {
+                const struct hll_part *hp = &hll.parts[i];
+
+                if (!hp->present)
+                        continue;
+
+                hll_write_int(fp, (uint32_t)i, 4);
+                hll_write_int(fp, hp->msgs, 8);
+                hll_write_int(fp, hp->null_keys, 8);
+                hll_write(fp, hp->regs, KC_HLL_REGS);
+        }
+
+        if (fclose(fp) == EOF)
+                FATAL("Failed to write key sketch file %s: %s",
+                      path, strerror(errno));
+
+        INFO(1, "Saved %"PRIu32" partition key sketches to %s\n",
+             cnt, path);
+}
+
+
+void hll_term (void) {
+        int i;
+
+        for (i = 0 ; i < hll.part_cnt ; i++)
+                free(hll.parts[i].regs);
+        free(hll.parts);
+        free(hll.total.regs);
+        memset(&hll, 0, sizeof(hll));
+
+        for (i = 0 ; i < hll_merge_cnt ; i++)
+                free(hll_merge_paths[i]);
+        free(hll_merge_paths);
+        hll_merge_paths = NULL;
+        hll_merge_cnt = 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+
+#include "kafkacat.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+
+/**
+ * Block-buffered producer input.
+ *
+ * Input is read in large blocks and split into messages by scanning
+ * the block for the message and key delimiters, so that each message
+ * is handed out as a slice of the block without any per-message
+ * copying or libc calls.
+ * A message straddling the end of the block is moved to the start of
+ * the buffer before the next read, and the buffer is grown if
+ * a single message does not fit.
+ */
+
+
+/**
+ * Returns a pointer to the first occurence of 'c1' or 'c2' in 's'..'end',
+ * or 'end' if neither is found.
+ */
+static const char *scan2_generic (const char *s, const char *end,
+                                  int c1, int c2) {
+        for ( ; s < end ; s++)
+                if (*(const unsigned char *)s == c1 ||
+                    *(const unsigned char *)s == c2)
+                        break;
+        return s;
+}
+
+#ifdef __SSE2__
+static const char *scan2_sse2 (const char *s, const char *end,
+                               int c1, int c2) {
+        const __m128i v1 = _mm_set1_epi8((char)c1);
+        const __m128i v2 = _mm_set1_epi8((char)c2);
+
+        while (end - s >= 16) {
+                __m128i d = _mm_loadu_si128((const __m128i *)s);
+                int m = _mm_movemask_epi8(
+                        _mm_or_si128(_mm_cmpeq_epi8(d, v1),
+                                     _mm_cmpeq_epi8(d, v2)));
+                if (m)
+                        return s + __builtin_ctz(m);
+                s += 16;
+        }
+
+        return scan2_generic(s, end, c1, c2);
+}
+#endif
+
+#if HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *scan2_avx2 (const char *s, const char *end,
+                               int c1, int c2) {
+        const __m256i v1 = _mm256_set1_epi8((char)c1);
+        const __m256i v2 = _mm256_set1_epi8((char)c2);
+
+        while (end - s >= 32) {
+                __m256i d = _mm256_loadu_si256((const __m256i *)s);
+                unsigned int m = (unsigned int)_mm256_movemask_epi8(
+                        _mm256_or_si256(_mm256_cmpeq_epi8(d, v1),
+                                        _mm256_cmpeq_epi8(d, v2)));
+                if (m)
+                        return s + __builtin_ctz(m);
+                s += 32;
+        }
+
+        return scan2_generic(s, end, c1, c2);
+}
+#endif
+
+
+static void inbuf_init0 (struct inbuf *ib, int delim, int key_delim) {
+        memset(ib, 0, sizeof(*ib));
+        ib->fd        = -1;
+        ib->delim     = delim;
+        ib->key_delim = key_delim;
+        ib->key_of    = -1;
+
+        ib->scan2 = scan2_generic;
+#ifdef __SSE2__
+        ib->scan2 = scan2_sse2;
+#endif
+#if HAVE_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                ib->scan2 = scan2_avx2;
+#endif
+}
+
+
+/**
+ * Initialize input buffer 'ib' reading from 'fd'.
+ * 'key_delim' is -1 if keys should not be extracted.
+ */
+void inbuf_init (struct inbuf *ib, int fd, size_t size,
+                 int delim, int key_delim) {
+        inbuf_init0(ib, delim, key_delim);
+
+        ib->fd   = fd;
+        ib->size = size;
+        ib->buf  = malloc(size);
+
+        if (!ib->buf)
+                FATAL("Failed to allocate %zd bytes input buffer", size);
+}
+
+
+/**
+ * Initialize input buffer 'ib' over the 'size' bytes at 'ptr',
+ * e.g., a memory mapped file. The memory is not owned by 'ib'.
+ */
+void inbuf_init_mem (struct inbuf *ib, char *ptr, size_t size,
+                     int delim, int key_delim) {
+        inbuf_init0(ib, delim, key_delim);
+
+        ib->buf  = ptr;
+        ib->size = size;
+        ib->len  = size;
+        ib->eof  = 1;
+}
+
+
+void inbuf_destroy (struct inbuf *ib) {
+        if (ib->fd != -1)
+                free(ib->buf);
+        ib->buf = NULL;
+}
+
+
+/**
+ * Read more data into the input buffer.
+ * Any partial message at the end of the buffer is first moved to
+ * the start of the buffer.
+ *
+ * Returns the number of bytes read, 0 on EOF, or -1 on error (errno set).
+ */
+ssize_t inbuf_fill (struct inbuf *ib) {
+        ssize_t r;
+
+        if (ib->of > 0) {
+                size_t remain = ib->len - ib->of;
+
+                if (remain > 0)
+                        memmove(ib->buf, ib->buf + ib->of, remain);
+
+                ib->scan -= ib->of;
+                if (ib->key_of != -1)
+                        ib->key_of -= ib->of;
+                ib->len   = remain;
+                ib->of    = 0;
+        }
+
+        if (ib->len == ib->size) {
+                /* Message does not fit in buffer: grow it */
+                char *nbuf = realloc(ib->buf, ib->size * 2);
+                if (!nbuf)
+                        FATAL("Failed to grow input buffer to %zd bytes",
+                              ib->size * 2);
+                ib->buf   = nbuf;
+                ib->size *= 2;
+        }
+
+        r = read(ib->fd, ib->buf + ib->len, ib->size - ib->len);
+        if (r > 0)
+                ib->len += r;
+        else if (r == 0)
+                ib->eof = 1;
+
+        return r;
+}
+
+
+/**
+ * Get next message from the input buffer.
+ *
+ * Returns 1 if a message was returned in 'msg', 0 if more input
+ * is needed (call inbuf_fill()), or -1 if input is exhausted.
+ *
+ * The returned slices are valid until the next call to inbuf_fill().
+ */
+int inbuf_next (struct inbuf *ib, struct inmsg *msg) {
+        char *start = ib->buf + ib->of;
+        const char *end = ib->buf + ib->len;
+        const char *p = ib->buf + ib->scan;
+        size_t delim_len = 1;
+
+        if (ib->of == ib->len)
+                return ib->eof ? -1 : 0;
+
+        while (1) {
+                if (ib->key_delim != -1 && ib->key_of == -1)
+                        p = ib->scan2(p, end, ib->delim, ib->key_delim);
+                else
+                        p = ib->scan2(p, end, ib->delim, ib->delim);
+
+                if (p == end || *(const unsigned char *)p == ib->delim)
+                        break;
+
+                /* First key delimiter in message */
+                ib->key_of = p - ib->buf;
+                p++;
+        }
+
+        if (p == end) {
+                ib->scan = ib->len;
+                if (!ib->eof)
+                        return 0;
+
+                /* Last message in input is not delimited */
+                delim_len = 0;
+        }
+
+        msg->raw     = start;
+        msg->raw_len = (p - start) + delim_len;
+        msg->payload = start;
+        msg->len     = p - start;
+
+        if (ib->key_of != -1) {
+                msg->key      = start;
+                msg->key_len  = ib->key_of - ib->of;
+                msg->payload += msg->key_len + 1;
+                msg->len     -= msg->key_len + 1;
+        } else {
+                msg->key      = NULL;
+                msg->key_len  = 0;
+        }
+
+        ib->of    += msg->raw_len;
+        ib->scan   = ib->of;
+        ib->key_of = -1;
+
+        return 1;
+}
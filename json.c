@@ -35,43 +35,168 @@
         yajl_gen_string(G, (const unsigned char *)_s, strlen(_s));      \
         } while (0)
 
-void fmt_msg_output_json (FILE *fp, const rd_kafka_message_t *rkmessage) {
-        yajl_gen g;
-        const char *topic = rd_kafka_topic_name(rkmessage->rkt);
-        const unsigned char *buf;
-        size_t len;
+/**
+ * Consumer JSON envelope (-J)
+ *
+ * The envelope is written straight to the consumer output rather than
+ * through a yajl generator, with the same string escaping as yajl:
+ * '"', '\\' and control characters are escaped, everything else,
+ * including non-ASCII bytes, is written as is.
+ * Strings are scanned for bytes to escape a vector at a time, and runs
+ * of safe bytes in keys and payloads are written by reference to the
+ * output like the delimited output's keys and payloads.
+ *
+ * With -E payloads, and with -EE also keys, that are valid JSON are
+ * embedded in the envelope as JSON values rather than as strings.
+ */
 
-        g = yajl_gen_alloc(NULL);
 
-        yajl_gen_map_open(g);
-        JS_STR(g, "topic");
-        JS_STR(g, topic);
+/**
+ * Write the escape sequence for 'c' to 'esc', returns its length.
+ */
+static size_t json_escape_char (char *esc, unsigned char c) {
+        static const char hex[] = "0123456789ABCDEF";
+
+        esc[0] = '\\';
+        switch (c)
+        {
+        case '"':  esc[1] = '"'; break;
+        case '\\': esc[1] = '\\'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\t': esc[1] = 't'; break;
+        case '\f': esc[1] = 'f'; break;
+        case '\b': esc[1] = 'b'; break;
+        default:
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 15];
+                return 6;
+        }
 
+        return 2;
+}
 
-        JS_STR(g, "partition");
-        yajl_gen_integer(g, (int)rkmessage->partition);
 
-        JS_STR(g, "offset");
-        yajl_gen_integer(g, (long long int)rkmessage->offset);
+/**
+ * Write the escaped contents of JSON string 's' of length 'len',
+ * which belongs to the message being output: runs of safe bytes
+ * are written by reference.
+ */
+static void json_write_escaped (struct output *out, const char *s,
+                                size_t len) {
+        const char *end = s + len;
 
+        while (s < end) {
+                const char *p = json_scan_escape(s, end);
+                char esc[6];
 
-        JS_STR(g, "key");
-        yajl_gen_string(g, (const unsigned char *)rkmessage->key,
-                        rkmessage->key_len);
+                if (p > s)
+                        output_write_ref(out, s, p - s);
 
-        JS_STR(g, "payload");
-        yajl_gen_string(g, (const unsigned char *)rkmessage->payload,
-                        rkmessage->len);
-        yajl_gen_map_close(g);
+                if (p == end)
+                        break;
 
-        yajl_gen_get_buf(g, &buf, &len);
+                output_write(out, esc,
+                             json_escape_char(esc, *(const unsigned char *)p));
+                s = p + 1;
+        }
+}
 
-        if (fwrite(buf, len, 1, fp) != 1 ||
-            (conf.fmt[0].str_len > 0 &&
-             fwrite(conf.fmt[0].str, conf.fmt[0].str_len, 1, fp) != 1))
-                FATAL("Output write error: %s", strerror(errno));
 
-        yajl_gen_free(g);
+
+
+/**
+ * Write key or payload 's' of length 'len' as a JSON string, or if 'raw'
+ * is set and it is valid JSON, as is.
+ * Values containing line breaks are compacted so that the envelope
+ * remains on one line.
+ */
+static void json_write_value (struct output *out, const char *s, size_t len,
+                              int raw) {
+        const char *start, *end;
+        int nl;
+
+        if (raw && len > 0 && json_validate(s, s + len, &start, &end, &nl)) {
+                if (nl)
+                        json_write_compact(out, start, end);
+                else
+                        output_write_ref(out, start, end - start);
+                return;
+        }
+
+        output_write(out, "\"", 1);
+        json_write_escaped(out, s, len);
+        output_write(out, "\"", 1);
+}
+
+
+/**
+ * Returns the envelope up to the partition value for topic 'rkt':
+ *   {"topic":"<topic>","partition":
+ * cached per formatter thread for the last topic.
+ */
+static const char *json_envelope_head (rd_kafka_topic_t *rkt, size_t *lenp) {
+        static __thread rd_kafka_topic_t *cached_rkt;
+        static __thread char *head;
+        static __thread size_t head_len;
+
+        if (rkt != cached_rkt) {
+                const char *topic = rd_kafka_topic_name(rkt);
+                const char *end = topic + strlen(topic);
+                char *p;
+
+                head = realloc(head, 10 + (end - topic) * 6 + 14);
+                p = head;
+
+                memcpy(p, "{\"topic\":\"", 10);
+                p += 10;
+                while (topic < end) {
+                        const char *t = json_scan_escape(topic, end);
+
+                        memcpy(p, topic, t - topic);
+                        p += t - topic;
+                        if (t == end)
+                                break;
+                        p += json_escape_char(p, *(const unsigned char *)t);
+                        topic = t + 1;
+                }
+                memcpy(p, "\",\"partition\":", 14);
+                p += 14;
+
+                head_len = p - head;
+                cached_rkt = rkt;
+        }
+
+        *lenp = head_len;
+        return head;
+}
+
+
+void fmt_msg_output_json (struct output *out,
+                          const rd_kafka_message_t *rkmessage) {
+        const char *head;
+        size_t len;
+
+        head = json_envelope_head(rkmessage->rkt, &len);
+        output_write(out, head, len);
+        fmt_write_int(out, rkmessage->partition);
+
+        output_write(out, ",\"offset\":", 10);
+        fmt_write_int(out, rkmessage->offset);
+
+        output_write(out, ",\"key\":", 7);
+        json_write_value(out, rkmessage->key, rkmessage->key_len,
+                         conf.flags & CONF_F_JSON_RAW_KEY);
+
+        output_write(out, ",\"payload\":", 11);
+        json_write_value(out, rkmessage->payload, rkmessage->len,
+                         conf.flags & CONF_F_JSON_RAW);
+
+        output_write(out, "}", 1);
+        output_write(out, conf.fmt[0].str, conf.fmt[0].str_len);
 }
 
 
@@ -206,6 +331,251 @@ void metadata_print_json (const struct rd_kafka_metadata *metadata) {
 
 
 
+static void summary_part_json (yajl_gen g, const struct summary_part *sp) {
+        int b;
+
+        yajl_gen_map_open(g);
+
+        if (sp->partition != -1) {
+                JS_STR(g, "partition");
+                yajl_gen_integer(g, (long long int)sp->partition);
+        }
+
+        JS_STR(g, "messages");
+        yajl_gen_integer(g, (long long int)sp->msgs);
+
+        if (sp->partition != -1) {
+                JS_STR(g, "first_offset");
+                if (sp->msgs > 0)
+                        yajl_gen_integer(g, (long long int)sp->first_offset);
+                else
+                        yajl_gen_null(g);
+
+                JS_STR(g, "last_offset");
+                if (sp->msgs > 0)
+                        yajl_gen_integer(g, (long long int)sp->last_offset);
+                else
+                        yajl_gen_null(g);
+        }
+
+        JS_STR(g, "key_bytes");
+        yajl_gen_integer(g, (long long int)sp->key_bytes);
+        JS_STR(g, "payload_bytes");
+        yajl_gen_integer(g, (long long int)sp->payload_bytes);
+        JS_STR(g, "null_keys");
+        yajl_gen_integer(g, (long long int)sp->null_keys);
+        JS_STR(g, "null_payloads");
+        yajl_gen_integer(g, (long long int)sp->null_payloads);
+
+        /* Non-empty payload size histogram buckets */
+        JS_STR(g, "payload_sizes");
+        yajl_gen_array_open(g);
+        for (b = 0 ; b < KC_SUMMARY_BUCKETS ; b++) {
+                uint64_t min, max;
+
+                if (!sp->hist[b])
+                        continue;
+
+                summary_bucket_range(b, &min, &max);
+
+                yajl_gen_map_open(g);
+                JS_STR(g, "min");
+                yajl_gen_integer(g, (long long int)min);
+                JS_STR(g, "max");
+                if (max == UINT64_MAX)
+                        yajl_gen_null(g);
+                else
+                        yajl_gen_integer(g, (long long int)max);
+                JS_STR(g, "messages");
+                yajl_gen_integer(g, (long long int)sp->hist[b]);
+                yajl_gen_map_close(g);
+        }
+        yajl_gen_array_close(g);
+
+        yajl_gen_map_close(g);
+}
+
+/**
+ * Print consumer summary (-s)
+ */
+void summary_print_json (FILE *fp) {
+        yajl_gen g;
+        int i;
+        const unsigned char *buf;
+        size_t len;
+
+        g = yajl_gen_alloc(NULL);
+
+        yajl_gen_map_open(g);
+
+        JS_STR(g, "topic");
+        JS_STR(g, conf.topic);
+
+        JS_STR(g, "partitions");
+        yajl_gen_array_open(g);
+        for (i = 0 ; i < summary.part_cnt ; i++)
+                if (summary.parts[i].consumed)
+                        summary_part_json(g, &summary.parts[i]);
+        yajl_gen_array_close(g);
+
+        JS_STR(g, "total");
+        summary_part_json(g, &summary.total);
+
+        yajl_gen_map_close(g);
+
+        yajl_gen_get_buf(g, &buf, &len);
+
+        if (fwrite(buf, len, 1, fp) != 1 || fputc('\n', fp) == EOF)
+                FATAL("Output write error: %s", strerror(errno));
+
+        yajl_gen_free(g);
+}
+
+
+
+/**
+ * Print consumer top keys (-H)
+ */
+void topkeys_print_json (FILE *fp, const struct topkeys_list *lists,
+                         int cnt) {
+        yajl_gen g;
+        int i, j;
+        const unsigned char *buf;
+        size_t len;
+
+        g = yajl_gen_alloc(NULL);
+
+        yajl_gen_map_open(g);
+
+        JS_STR(g, "topic");
+        JS_STR(g, conf.topic);
+
+        JS_STR(g, "top_keys");
+        yajl_gen_array_open(g);
+        for (i = 0 ; i < cnt ; i++) {
+                const struct topkeys_list *list = &lists[i];
+
+                yajl_gen_map_open(g);
+
+                JS_STR(g, "partition");
+                if (list->partition == -1)
+                        yajl_gen_null(g);
+                else
+                        yajl_gen_integer(g, (long long int)list->partition);
+
+                JS_STR(g, "by");
+                JS_STR(g, list->what);
+
+                JS_STR(g, "total");
+                yajl_gen_integer(g, (long long int)list->total);
+
+                JS_STR(g, "keys");
+                yajl_gen_array_open(g);
+                for (j = 0 ; j < list->cnt ; j++) {
+                        const struct topk_entry *e = &list->keys[j];
+
+                        yajl_gen_map_open(g);
+
+                        /* Keys longer than KC_TOPK_KEY_MAX are
+                         * truncated, see key_len */
+                        JS_STR(g, "key");
+                        if (e->key_len == -1)
+                                yajl_gen_null(g);
+                        else
+                                yajl_gen_string(g,
+                                                (const unsigned char *)
+                                                e->key,
+                                                e->key_len < KC_TOPK_KEY_MAX ?
+                                                (size_t)e->key_len :
+                                                KC_TOPK_KEY_MAX);
+
+                        JS_STR(g, "key_len");
+                        yajl_gen_integer(g, (long long int)e->key_len);
+
+                        JS_STR(g, "count");
+                        yajl_gen_integer(g, (long long int)e->count);
+
+                        JS_STR(g, "error");
+                        yajl_gen_integer(g, (long long int)e->error);
+
+                        yajl_gen_map_close(g);
+                }
+                yajl_gen_array_close(g);
+
+                yajl_gen_map_close(g);
+        }
+        yajl_gen_array_close(g);
+
+        yajl_gen_map_close(g);
+
+        yajl_gen_get_buf(g, &buf, &len);
+
+        if (fwrite(buf, len, 1, fp) != 1 || fputc('\n', fp) == EOF)
+                FATAL("Output write error: %s", strerror(errno));
+
+        yajl_gen_free(g);
+}
+
+
+static void hll_part_json (yajl_gen g, const struct hll_part *hp) {
+        yajl_gen_map_open(g);
+
+        if (hp->partition != -1) {
+                JS_STR(g, "partition");
+                yajl_gen_integer(g, (long long int)hp->partition);
+        }
+
+        JS_STR(g, "messages");
+        yajl_gen_integer(g, (long long int)hp->msgs);
+        JS_STR(g, "null_keys");
+        yajl_gen_integer(g, (long long int)hp->null_keys);
+        JS_STR(g, "distinct_keys");
+        yajl_gen_integer(g, (long long int)hp->distinct);
+
+        yajl_gen_map_close(g);
+}
+
+/**
+ * Print consumer distinct key estimates (-a)
+ */
+void hll_print_json (FILE *fp) {
+        yajl_gen g;
+        int i;
+        const unsigned char *buf;
+        size_t len;
+
+        g = yajl_gen_alloc(NULL);
+
+        yajl_gen_map_open(g);
+
+        JS_STR(g, "topic");
+        JS_STR(g, conf.topic);
+
+        JS_STR(g, "precision");
+        yajl_gen_integer(g, KC_HLL_PRECISION);
+
+        JS_STR(g, "partitions");
+        yajl_gen_array_open(g);
+        for (i = 0 ; i < hll.part_cnt ; i++)
+                if (hll.parts[i].present)
+                        hll_part_json(g, &hll.parts[i]);
+        yajl_gen_array_close(g);
+
+        JS_STR(g, "total");
+        hll_part_json(g, &hll.total);
+
+        yajl_gen_map_close(g);
+
+        yajl_gen_get_buf(g, &buf, &len);
+
+        if (fwrite(buf, len, 1, fp) != 1 || fputc('\n', fp) == EOF)
+                FATAL("Output write error: %s", strerror(errno));
+
+        yajl_gen_free(g);
+}
+
+
+
 void fmt_init_json (void) {
 }
 
@@ -0,0 +1,691 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+
+#include "kafkacat.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+
+/**
+ * JSON scanning, used by the -J envelope (json.c) and by %{json:..}
+ * payload field projection.
+ *
+ * Nothing is parsed into a document: values are validated or skipped
+ * in place, looking at most bytes a vector at a time, and located
+ * values are written by reference to the output.
+ * The scanners do not validate UTF-8.
+ */
+
+
+static int json_needs_escape (unsigned char c) {
+        return c < 0x20 || c == '"' || c == '\\';
+}
+
+/**
+ * Returns a pointer to the first byte in 's'..'end' that must be escaped
+ * in a JSON string, or 'end' if none.
+ */
+static const char *json_scan_generic (const char *s, const char *end) {
+        for ( ; s < end ; s++)
+                if (json_needs_escape(*(const unsigned char *)s))
+                        break;
+        return s;
+}
+
+#ifdef __SSE2__
+static const char *json_scan_sse2 (const char *s, const char *end) {
+        const __m128i vq = _mm_set1_epi8('"');
+        const __m128i vb = _mm_set1_epi8('\\');
+        const __m128i vc = _mm_set1_epi8(0x1f);
+
+        while (end - s >= 16) {
+                __m128i d = _mm_loadu_si128((const __m128i *)s);
+                /* min(d, 0x1f) == d  <=>  d <= 0x1f, unsigned */
+                int m = _mm_movemask_epi8(
+                        _mm_or_si128(
+                                _mm_or_si128(_mm_cmpeq_epi8(d, vq),
+                                             _mm_cmpeq_epi8(d, vb)),
+                                _mm_cmpeq_epi8(_mm_min_epu8(d, vc), d)));
+                if (m)
+                        return s + __builtin_ctz(m);
+                s += 16;
+        }
+
+        return json_scan_generic(s, end);
+}
+#endif
+
+#if HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *json_scan_avx2 (const char *s, const char *end) {
+        const __m256i vq = _mm256_set1_epi8('"');
+        const __m256i vb = _mm256_set1_epi8('\\');
+        const __m256i vc = _mm256_set1_epi8(0x1f);
+
+        while (end - s >= 32) {
+                __m256i d = _mm256_loadu_si256((const __m256i *)s);
+                unsigned int m = (unsigned int)_mm256_movemask_epi8(
+                        _mm256_or_si256(
+                                _mm256_or_si256(_mm256_cmpeq_epi8(d, vq),
+                                                _mm256_cmpeq_epi8(d, vb)),
+                                _mm256_cmpeq_epi8(_mm256_min_epu8(d, vc),
+                                                  d)));
+                if (m)
+                        return s + __builtin_ctz(m);
+                s += 32;
+        }
+
+        return json_scan_generic(s, end);
+}
+#endif
+
+const char *(*json_scan_escape) (const char *s, const char *end) =
+        json_scan_generic;
+
+
+#define JSON_DEPTH_MAX  256  /* Deeper values are considered invalid */
+
+static int json_is_ws (char c) {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/**
+ * Skip whitespace, setting '*nlp' if it contains line breaks.
+ */
+static const char *json_skip_ws (const char *s, const char *end, int *nlp) {
+        for ( ; s < end && json_is_ws(*s) ; s++)
+                if (*s == '\n' || *s == '\r')
+                        *nlp = 1;
+        return s;
+}
+
+/**
+ * Skip the rest of the JSON string starting after its opening quote.
+ * Returns a pointer past the closing quote, or NULL if invalid.
+ */
+static const char *json_skip_string (const char *s, const char *end) {
+        while (1) {
+                const char *p = json_scan_escape(s, end);
+                int i;
+
+                if (p == end)
+                        return NULL;
+
+                if (*p == '"')
+                        return p + 1;
+
+                if (*p != '\\' || p + 1 == end)
+                        return NULL; /* Control character */
+
+                switch (p[1])
+                {
+                case '"': case '\\': case '/':
+                case 'b': case 'f': case 'n': case 'r': case 't':
+                        s = p + 2;
+                        break;
+                case 'u':
+                        if (end - p < 6)
+                                return NULL;
+                        for (i = 2 ; i < 6 ; i++)
+                                if (!isxdigit((unsigned char)p[i]))
+                                        return NULL;
+                        s = p + 6;
+                        break;
+                default:
+                        return NULL;
+                }
+        }
+}
+
+static const char *json_skip_digits (const char *s, const char *end) {
+        while (s < end && *s >= '0' && *s <= '9')
+                s++;
+        return s;
+}
+
+/**
+ * Skip the JSON number at 's'.
+ * Returns a pointer past the number, or NULL if invalid.
+ */
+static const char *json_skip_number (const char *s, const char *end) {
+        const char *t;
+
+        if (*s == '-')
+                s++;
+
+        if (s < end && *s == '0')
+                s++;
+        else if ((t = json_skip_digits(s, end)) > s)
+                s = t;
+        else
+                return NULL;
+
+        if (s < end && *s == '.') {
+                if ((t = json_skip_digits(s + 1, end)) == s + 1)
+                        return NULL;
+                s = t;
+        }
+
+        if (s < end && (*s == 'e' || *s == 'E')) {
+                s++;
+                if (s < end && (*s == '+' || *s == '-'))
+                        s++;
+                if ((t = json_skip_digits(s, end)) == s)
+                        return NULL;
+                s = t;
+        }
+
+        return s;
+}
+
+static const char *json_skip_literal (const char *s, const char *end,
+                                      const char *lit, size_t len) {
+        if ((size_t)(end - s) < len || memcmp(s, lit, len))
+                return NULL;
+        return s + len;
+}
+
+
+/**
+ * Validate the JSON value in 's'..'end', which may be surrounded by
+ * whitespace, strictly.
+ * Returns 1 if valid, with the value's extent in '*startp'..'*endp'
+ * and '*nlp' set if it contains line breaks, else 0.
+ */
+int json_validate (const char *s, const char *end,
+                   const char **startp, const char **endp, int *nlp) {
+        char stack[JSON_DEPTH_MAX]; /* Expected closing brackets */
+        int depth = 0;
+
+        *nlp = 0;
+        s = json_skip_ws(s, end, nlp);
+        *startp = s;
+
+        while (1) {
+                /* Value */
+                if (s == end)
+                        return 0;
+
+                switch (*s)
+                {
+                case '{':
+                case '[':
+                        if (depth == JSON_DEPTH_MAX)
+                                return 0;
+                        stack[depth++] = *s == '{' ? '}' : ']';
+                        s = json_skip_ws(s + 1, end, nlp);
+                        if (s < end && *s == stack[depth-1]) {
+                                depth--;
+                                s++;
+                                break;
+                        }
+                        if (stack[depth-1] == '}')
+                                goto key;
+                        continue;
+                case '"':
+                        s = json_skip_string(s + 1, end);
+                        break;
+                case 't':
+                        s = json_skip_literal(s, end, "true", 4);
+                        break;
+                case 'f':
+                        s = json_skip_literal(s, end, "false", 5);
+                        break;
+                case 'n':
+                        s = json_skip_literal(s, end, "null", 4);
+                        break;
+                default:
+                        s = json_skip_number(s, end);
+                        break;
+                }
+
+                if (!s)
+                        return 0;
+
+                /* After a value: close containers, or next element */
+                while (1) {
+                        if (depth == 0) {
+                                *endp = s;
+                                return json_skip_ws(s, end, nlp) == end;
+                        }
+
+                        s = json_skip_ws(s, end, nlp);
+                        if (s == end)
+                                return 0;
+
+                        if (*s != stack[depth-1])
+                                break;
+
+                        depth--;
+                        s++;
+                }
+
+                if (*s != ',')
+                        return 0;
+
+                s = json_skip_ws(s + 1, end, nlp);
+                if (stack[depth-1] == ']')
+                        continue;
+
+        key:
+                /* Object member name */
+                if (s == end || *s != '"' ||
+                    !(s = json_skip_string(s + 1, end)))
+                        return 0;
+                s = json_skip_ws(s, end, nlp);
+                if (s == end || *s != ':')
+                        return 0;
+                s = json_skip_ws(s + 1, end, nlp);
+        }
+}
+
+
+/**
+ * Write valid JSON value 's'..'end', which belongs to the message being
+ * output, without whitespace outside of strings.
+ */
+void json_write_compact (struct output *out, const char *s, const char *end) {
+        while (s < end) {
+                const char *p = s;
+
+                while (p < end && !json_is_ws(*p)) {
+                        if (*p != '"')
+                                p++;
+                        else if (!(p = json_skip_string(p + 1, end)))
+                                p = end;
+                }
+
+                output_write_ref(out, s, p - s);
+
+                while (p < end && json_is_ws(*p))
+                        p++;
+                s = p;
+        }
+}
+
+
+/**
+ * Returns a pointer to the first '"', '[', ']', '{' or '}' in 's'..'end',
+ * or 'end' if none.
+ */
+static const char *json_scan_struct_generic (const char *s, const char *end) {
+        for ( ; s < end ; s++)
+                if (*s == '"' || (*s | 0x20) == '{' || (*s | 0x20) == '}')
+                        break;
+        return s;
+}
+
+#ifdef __SSE2__
+static const char *json_scan_struct_sse2 (const char *s, const char *end) {
+        const __m128i vq = _mm_set1_epi8('"');
+        const __m128i vo = _mm_set1_epi8('{');
+        const __m128i vc = _mm_set1_epi8('}');
+        const __m128i v20 = _mm_set1_epi8(0x20);
+
+        while (end - s >= 16) {
+                __m128i d = _mm_loadu_si128((const __m128i *)s);
+                /* '[' and ']' are '{' and '}' without bit 0x20 */
+                __m128i l = _mm_or_si128(d, v20);
+                int m = _mm_movemask_epi8(
+                        _mm_or_si128(
+                                _mm_cmpeq_epi8(d, vq),
+                                _mm_or_si128(_mm_cmpeq_epi8(l, vo),
+                                             _mm_cmpeq_epi8(l, vc))));
+                if (m)
+                        return s + __builtin_ctz(m);
+                s += 16;
+        }
+
+        return json_scan_struct_generic(s, end);
+}
+#endif
+
+#if HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *json_scan_struct_avx2 (const char *s, const char *end) {
+        const __m256i vq = _mm256_set1_epi8('"');
+        const __m256i vo = _mm256_set1_epi8('{');
+        const __m256i vc = _mm256_set1_epi8('}');
+        const __m256i v20 = _mm256_set1_epi8(0x20);
+
+        while (end - s >= 32) {
+                __m256i d = _mm256_loadu_si256((const __m256i *)s);
+                __m256i l = _mm256_or_si256(d, v20);
+                unsigned int m = (unsigned int)_mm256_movemask_epi8(
+                        _mm256_or_si256(
+                                _mm256_cmpeq_epi8(d, vq),
+                                _mm256_or_si256(_mm256_cmpeq_epi8(l, vo),
+                                                _mm256_cmpeq_epi8(l, vc))));
+                if (m)
+                        return s + __builtin_ctz(m);
+                s += 32;
+        }
+
+        return json_scan_struct_generic(s, end);
+}
+#endif
+
+static const char *(*json_scan_struct) (const char *s, const char *end) =
+        json_scan_struct_generic;
+
+
+/**
+ * Skip the JSON value at 's' without validating containers: they are
+ * skipped by matching brackets, looking only at brackets and strings.
+ * Returns a pointer past the value, or NULL if it is not terminated
+ * or is an invalid scalar.
+ */
+static const char *json_skip_value (const char *s, const char *end) {
+        int depth = 0;
+
+        switch (*s)
+        {
+        case '"':
+                return json_skip_string(s + 1, end);
+        case '{':
+        case '[':
+                break;
+        case 't':
+                s = json_skip_literal(s, end, "true", 4);
+                goto scalar;
+        case 'f':
+                s = json_skip_literal(s, end, "false", 5);
+                goto scalar;
+        case 'n':
+                s = json_skip_literal(s, end, "null", 4);
+                goto scalar;
+        default:
+                s = json_skip_number(s, end);
+        scalar:
+                if (!s || (s < end && !json_is_ws(*s) &&
+                           *s != ',' && *s != '}' && *s != ']'))
+                        return NULL;
+                return s;
+        }
+
+        while ((s = json_scan_struct(s, end)) < end) {
+                switch (*s)
+                {
+                case '"':
+                        if (!(s = json_skip_string(s + 1, end)))
+                                return NULL;
+                        continue;
+                case '{':
+                case '[':
+                        depth++;
+                        break;
+                default:
+                        if (--depth == 0)
+                                return s + 1;
+                        break;
+                }
+                s++;
+        }
+
+        return NULL;
+}
+
+
+/**
+ * Find member 'name' in the object whose members start at 's'.
+ * Returns a pointer to the member's value, or NULL if not found.
+ * Member names are compared as encoded.
+ */
+static const char *json_object_member (const char *s, const char *end,
+                                       const char *name, size_t name_len) {
+        int nl;
+
+        s = json_skip_ws(s, end, &nl);
+        if (s < end && *s == '}')
+                return NULL;
+
+        while (1) {
+                const char *key, *key_end;
+
+                if (s == end || *s != '"')
+                        return NULL;
+
+                key = s + 1;
+                if (!(s = json_skip_string(key, end)))
+                        return NULL;
+                key_end = s - 1;
+
+                s = json_skip_ws(s, end, &nl);
+                if (s == end || *s != ':')
+                        return NULL;
+
+                s = json_skip_ws(s + 1, end, &nl);
+                if (s == end)
+                        return NULL;
+
+                if ((size_t)(key_end - key) == name_len &&
+                    !memcmp(key, name, name_len))
+                        return s;
+
+                if (!(s = json_skip_value(s, end)))
+                        return NULL;
+
+                s = json_skip_ws(s, end, &nl);
+                if (s == end || *s != ',')
+                        return NULL;
+                s = json_skip_ws(s + 1, end, &nl);
+        }
+}
+
+
+/**
+ * Find element 'idx' in the array whose elements start at 's'.
+ * Returns a pointer to the element, or NULL if not found.
+ */
+static const char *json_array_element (const char *s, const char *end,
+                                       int idx) {
+        int nl;
+
+        s = json_skip_ws(s, end, &nl);
+        if (s < end && *s == ']')
+                return NULL;
+
+        while (s < end) {
+                if (idx-- == 0)
+                        return s;
+
+                if (!(s = json_skip_value(s, end)))
+                        return NULL;
+
+                s = json_skip_ws(s, end, &nl);
+                if (s == end || *s != ',')
+                        return NULL;
+                s = json_skip_ws(s + 1, end, &nl);
+        }
+
+        return NULL;
+}
+
+
+
+/**
+ * JSON path: $.name, $["name"] and $[index] steps from the root.
+ */
+struct json_path {
+        int cnt;
+        struct json_path_step {
+                char  *name;      /* Member name, or NULL for an index */
+                size_t name_len;
+                int    idx;
+        } steps[];
+};
+
+
+/**
+ * Parse JSON path 'str' of length 'len'.
+ * The leading '$' is optional, e.g., "user.id" is "$.user.id".
+ */
+struct json_path *json_path_parse (const char *str, size_t len) {
+        const char *s = str, *end = str + len;
+        struct json_path *jp;
+
+        /* No more steps than characters */
+        jp = calloc(1, sizeof(*jp) + sizeof(*jp->steps) * len);
+
+        if (s < end && *s == '$')
+                s++;
+
+        while (s < end) {
+                struct json_path_step *step = &jp->steps[jp->cnt++];
+                const char *t;
+
+                if (*s == '.' || (s == str && *s != '[')) {
+                        /* The leading '.' is optional without '$' */
+                        if (*s == '.')
+                                s++;
+                        for (t = s ; t < end && *t != '.' && *t != '[' ;
+                             t++)
+                                ;
+                        if (t == s)
+                                FATAL("Empty member name in JSON path: %.*s",
+                                      (int)len, str);
+                        step->name = strndup(s, t - s);
+                        step->name_len = t - s;
+                        s = t;
+
+                } else if (*s == '[' && s + 1 < end && s[1] == '"') {
+                        s += 2;
+                        if (!(t = memchr(s, '"', end - s)) ||
+                            t + 1 == end || t[1] != ']')
+                                FATAL("Unterminated member name in "
+                                      "JSON path: %.*s", (int)len, str);
+                        step->name = strndup(s, t - s);
+                        step->name_len = t - s;
+                        s = t + 2;
+
+                } else if (*s == '[') {
+                        char *tend;
+                        long idx = strtol(s + 1, &tend, 10);
+
+                        if (tend == s + 1 || tend >= end || *tend != ']' ||
+                            idx < 0 || idx > INT32_MAX)
+                                FATAL("Invalid array index in JSON path: "
+                                      "%.*s", (int)len, str);
+                        step->idx = (int)idx;
+                        s = tend + 1;
+
+                } else
+                        FATAL("Invalid JSON path: %.*s", (int)len, str);
+        }
+
+        return jp;
+}
+
+/**
+ * Returns the end of the JSON path starting at 'str': the first
+ * 'term' character that is not in a quoted member name,
+ * or NULL if there is none.
+ */
+const char *json_path_end (const char *str, char term) {
+        const char *s = str;
+
+        while (*s && *s != term) {
+                if (s[0] == '[' && s[1] == '"') {
+                        if (!(s = strchr(s + 2, '"')))
+                                return NULL;
+                }
+                s++;
+        }
+
+        return *s ? s : NULL;
+}
+
+void json_path_destroy (struct json_path *jp) {
+        int i;
+
+        for (i = 0 ; i < jp->cnt ; i++)
+                free(jp->steps[i].name);
+        free(jp);
+}
+
+
+/**
+ * Look up path 'jp' in JSON document 's'..'end', skipping everything
+ * not on the path.
+ * Returns 1 if found, with the value's extent in '*startp'..'*endp',
+ * else 0.
+ */
+int json_path_get (const struct json_path *jp, const char *s, const char *end,
+                   const char **startp, const char **endp) {
+        int nl;
+        int i;
+
+        s = json_skip_ws(s, end, &nl);
+
+        for (i = 0 ; i < jp->cnt && s < end ; i++) {
+                const struct json_path_step *step = &jp->steps[i];
+
+                if (step->name) {
+                        if (*s != '{')
+                                return 0;
+                        s = json_object_member(s + 1, end,
+                                               step->name, step->name_len);
+                } else {
+                        if (*s != '[')
+                                return 0;
+                        s = json_array_element(s + 1, end, step->idx);
+                }
+
+                if (!s)
+                        return 0;
+        }
+
+        if (s == end || !(*endp = json_skip_value(s, end)) || *endp == s)
+                return 0;
+
+        *startp = s;
+        return 1;
+}
+
+
+
+void json_scan_init (void) {
+#ifdef __SSE2__
+        json_scan_escape = json_scan_sse2;
+        json_scan_struct = json_scan_struct_sse2;
+#endif
+#if HAVE_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+                json_scan_escape = json_scan_avx2;
+                json_scan_struct = json_scan_struct_avx2;
+        }
+#endif
+}
@@ -30,12 +30,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <signal.h>
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 
 #include "kafkacat.h"
@@ -46,16 +49,66 @@ struct conf conf = {
         .verbosity = 1,
         .partition = RD_KAFKA_PARTITION_UA,
         .msg_size = 1024*1024,
+        .producer_cnt = 1,
+        .consumer_cnt = 1,
+        .flush_ms = KC_FLUSH_MS,
+        .batch_timeout_ms = 100,
         .null_str = "NULL",
 };
 
-static struct stats {
+/**
+ * Producer instance statistics
+ */
+struct producer_stats {
         uint64_t tx;
         uint64_t tx_err_q;
         uint64_t tx_err_dr;
         uint64_t tx_delivered;
+        uint64_t tx_backpressure;
+
+        /* Produced messages awaiting delivery report */
+        int64_t  inflight_msgs;
+        int64_t  inflight_bytes;
 
+        /* Reader ring (-R, -N) */
+        struct ring_stats ring;
+};
+
+/**
+ * Consumer instance statistics
+ */
+struct consumer_stats {
         uint64_t rx;
+        uint64_t offset_stores;   /* rd_kafka_offset_store() calls */
+
+        /* Consume batches (-B) */
+        uint64_t batches;
+        uint64_t batch_max;
+
+        /* Filter (-g, -G) */
+        struct filter_stats filter;
+
+        /* Key set (-k) */
+        struct keyset_stats keyset;
+
+        /* Output */
+        struct output_stats out;
+};
+
+static struct stats {
+        /* Producer totals over all instances */
+        struct producer_stats tx;
+
+        /* Producer file read ahead (-j) */
+        struct fileq_stats files;
+
+        /* Consumer totals over all instances */
+        struct consumer_stats rx;
+        uint64_t rx_min;    /* Fewest messages consumed by an instance */
+        uint64_t rx_max;    /* Most messages consumed by an instance */
+
+        /* Consumer formatting pipeline (-j) */
+        struct fmtpipe_stats pipe;
 } stats;
 
 
@@ -68,6 +121,100 @@ int part_eof_thres = 0;
 
 
 
+/**
+ * Print statistics to stderr (with -v)
+ */
+static void stats_print (void) {
+        const struct producer_stats *tx = &stats.tx;
+        const struct consumer_stats *rx = &stats.rx;
+
+        if (conf.mode == 'P') {
+                INFO(2, "Produced %"PRIu64" messages: "
+                     "%"PRIu64" delivered, %"PRIu64" failed, "
+                     "%"PRIu64" queue full retries, "
+                     "%"PRIu64" in-flight waits\n",
+                     tx->tx, tx->tx_delivered, tx->tx_err_dr,
+                     tx->tx_err_q, tx->tx_backpressure);
+                INFO(2, "Message buffer pool: %"PRIu64" hits, "
+                     "%"PRIu64" misses, %"PRIu64" bytes resident\n",
+                     pool_stats.hits, pool_stats.misses,
+                     pool_stats.bytes_resident);
+                if (tx->ring.pops > 0)
+                        INFO(2, "Reader ring: %i x %i slots, "
+                             "%.1f average and %"PRIu64" max occupancy, "
+                             "%"PRIu64" full waits (producer bound), "
+                             "%"PRIu64" empty waits (reader bound)\n",
+                             conf.producer_cnt, conf.ring_depth,
+                             (double)tx->ring.occupancy_sum /
+                             tx->ring.pops,
+                             tx->ring.occupancy_max,
+                             tx->ring.push_waits, tx->ring.pop_waits);
+                if (stats.files.files > 0)
+                        INFO(2, "File read ahead: %"PRIu64" files, "
+                             "%i threads, "
+                             "%"PRIu64" waits for files (reader bound)\n",
+                             stats.files.files, conf.file_threads,
+                             stats.files.waits);
+        } else if (conf.mode == 'C') {
+                INFO(2, "Consumed %"PRIu64" messages, "
+                     "%"PRIu64" offset stores\n",
+                     rx->rx, rx->offset_stores);
+                if (conf.consumer_cnt > 1)
+                        INFO(2, "Consumer instances: %i, "
+                             "%"PRIu64" to %"PRIu64" messages "
+                             "per instance\n",
+                             conf.consumer_cnt, stats.rx_min, stats.rx_max);
+                if (rx->batches > 0)
+                        INFO(2, "Consume batches: %"PRIu64" batches of "
+                             "%.1f average and %"PRIu64" max messages "
+                             "(-B %i,%i)\n",
+                             rx->batches,
+                             (double)rx->rx / rx->batches,
+                             rx->batch_max,
+                             conf.batch_size, conf.batch_timeout_ms);
+                if (rx->keyset.lookups > 0)
+                        INFO(2, "Key set: %"PRIu64" of %"PRIu64" keys "
+                             "matched, %"PRIu64" passed the Bloom filter "
+                             "(%"PRIu64" false positives)\n",
+                             rx->keyset.matched, rx->keyset.lookups,
+                             rx->keyset.bloom_passed,
+                             rx->keyset.bloom_passed - rx->keyset.matched);
+                if (rx->filter.msgs > 0)
+                        INFO(2, "Filter: %"PRIu64" of %"PRIu64" messages "
+                             "(%.2f%%) and %"PRIu64" of %"PRIu64" bytes "
+                             "matched\n",
+                             rx->filter.matched, rx->filter.msgs,
+                             100.0 * rx->filter.matched / rx->filter.msgs,
+                             rx->filter.matched_bytes, rx->filter.bytes);
+                if (stats.pipe.jobs > 0)
+                        INFO(2, "Format pipeline: %i threads, "
+                             "%"PRIu64" jobs, "
+                             "%"PRIu64" full waits (formatter bound), "
+                             "%"PRIu64" writer waits\n",
+                             conf.fmt_threads, stats.pipe.jobs,
+                             stats.pipe.submit_waits,
+                             stats.pipe.writer_waits);
+                if (rx->out.writes > 0)
+                        INFO(2, "Output: %"PRIu64" bytes in %"PRIu64" writes, "
+                             "%"PRIu64" bytes copied, "
+                             "%"PRIu64" bytes written from messages, "
+                             "%"PRIu64" timed flushes\n",
+                             rx->out.bytes, rx->out.writes,
+                             rx->out.copied, rx->out.referenced,
+                             rx->out.timed_flushes);
+                if (conf.reasm_dir)
+                        INFO(2, "Reassembled %"PRIu64" files "
+                             "from %"PRIu64" chunks: "
+                             "%"PRIu64" dropped, %"PRIu64" incomplete, "
+                             "%"PRIu64" messages skipped\n",
+                             reasm_stats.files, reasm_stats.chunks,
+                             reasm_stats.failed, reasm_stats.incomplete,
+                             reasm_stats.skipped);
+        }
+}
+
+
+
 /**
  * Fatal error: print error and exit
  */
@@ -82,35 +229,160 @@ void __attribute__((noreturn)) fatal0 (const char *func, int line,
 
         INFO(2, "Fatal error at %s:%i:\n", func, line);
         fprintf(stderr, "%% ERROR: %s\n", buf);
+
+        /* Write out messages consumed so far */
+        output_flush_all();
+
         exit(1);
 }
 
 
 
+/**
+ * Memory mapped input file for line mode (-l).
+ * Each message produced from the file is a slice of the mapping and
+ * holds a reference to it, the file is unmapped when the last
+ * message's delivery report has been served.
+ * The reference count is atomic since references are taken by
+ * the reader thread (-R) and released by the produce thread.
+ */
+struct mapped_file {
+        kc_msg_owner_t owner;
+        char   *ptr;
+        size_t  size;
+        int     refcnt;
+};
+
+
+/**
+ * Memory map the regular file opened as 'fp'.
+ * Returns NULL if 'fp' is not a regular file or could not be mapped,
+ * in which case it should be read as a stream instead.
+ */
+static struct mapped_file *mapped_file_new (FILE *fp, const char *path) {
+        struct mapped_file *mf;
+        struct stat st;
+        void *ptr;
+
+        if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) ||
+            st.st_size == 0)
+                return NULL;
+
+        ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (ptr == MAP_FAILED) {
+                INFO(2, "Failed to mmap %s: %s: reading as stream\n",
+                     path, strerror(errno));
+                return NULL;
+        }
+
+        /* The file is read once from start to end */
+        madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+
+        mf = malloc(sizeof(*mf));
+        mf->owner  = KC_MSG_OWNER_MAPPED_FILE;
+        mf->ptr    = ptr;
+        mf->size   = st.st_size;
+        mf->refcnt = 1;
+
+        return mf;
+}
+
+
+static void mapped_file_ref (struct mapped_file *mf) {
+        __atomic_add_fetch(&mf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void mapped_file_unref (struct mapped_file *mf) {
+        if (__atomic_sub_fetch(&mf->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+
+        munmap(mf->ptr, mf->size);
+        free(mf);
+}
+
+
+
+/**
+ * Release payload memory owned by kafkacat, referenced by
+ * message opaque 'msg_opaque'.
+ */
+static void msg_opaque_release (void *msg_opaque) {
+        if (!msg_opaque)
+                return;
+
+        switch (*(kc_msg_owner_t *)msg_opaque)
+        {
+        case KC_MSG_OWNER_MAPPED_FILE:
+                mapped_file_unref(msg_opaque);
+                break;
+        case KC_MSG_OWNER_POOL:
+                pool_put(msg_opaque);
+                break;
+        }
+}
+
+
+/**
+ * Producer instance.
+ * The producer normally runs a single instance on the main thread,
+ * with -N the input is sharded over multiple instances that each
+ * run in their own thread, see producer_shard().
+ */
+struct producer {
+        rd_kafka_t        *rk;
+        rd_kafka_topic_t  *rkt;
+
+        /* Message batch, see produce_batch_flush() */
+        struct {
+                int32_t             partition;
+                rd_kafka_message_t *msgs;
+                int                 cnt;
+        } batch;
+
+        /* Delivery report event pipe, see producer_wait_input() */
+        int                dr_event_fds[2];
+
+        /* Messages from the reader, see produce_lines_pipelined() */
+        struct ring       *ring;
+        pthread_t          thrd;
+
+        struct producer_stats stats;
+};
+
+static struct producer *producers;
+
+
 /**
  * The delivery report callback is called once per message to
  * report delivery success or failure.
  */
 static void dr_msg_cb (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage,
                        void *opaque) {
+        struct producer *p = opaque;
         static int say_once = 1;
 
+        p->stats.inflight_msgs--;
+        p->stats.inflight_bytes -= rkmessage->len;
+
+        /* Release payload memory owned by kafkacat */
+        msg_opaque_release(rkmessage->_private);
+
         if (rkmessage->err) {
                 INFO(1, "Delivery failed for message: %s\n",
                      rd_kafka_err2str(rkmessage->err));
-                stats.tx_err_dr++;
+                p->stats.tx_err_dr++;
                 return;
         }
 
         INFO(3, "Message delivered to partition %"PRId32" (offset %"PRId64")\n",
              rkmessage->partition, rkmessage->offset);
 
-        if (rkmessage->offset == 0 && say_once) {
+        /* Shared by all producer instances */
+        if (rkmessage->offset == 0 &&
+            __atomic_exchange_n(&say_once, 0, __ATOMIC_RELAXED))
                 INFO(3, "Enable message offset reporting "
                      "with '-X topic.produce.offset.report=true'\n");
-                say_once = 0;
-        }
-        stats.tx_delivered++;
+        p->stats.tx_delivered++;
 }
 
 
@@ -118,8 +390,9 @@ static void dr_msg_cb (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage,
  * Produces a single message, retries on queue congestion, and
  * exits hard on error.
  */
-static void produce (void *buf, size_t len,
-                     const void *key, size_t key_len, int msgflags) {
+static void produce (struct producer *p, void *buf, size_t len,
+                     const void *key, size_t key_len, int msgflags,
+                     void *msg_opaque) {
 
         /* Produce message: keep trying until it succeeds. */
         do {
@@ -129,9 +402,12 @@ static void produce (void *buf, size_t len,
                         FATAL("Program terminated while "
                               "producing message of %zd bytes", len);
 
-                if (rd_kafka_produce(conf.rkt, conf.partition, msgflags,
-                                     buf, len, key, key_len, NULL) != -1) {
-                        stats.tx++;
+                if (rd_kafka_produce(p->rkt, conf.partition, msgflags,
+                                     buf, len, key, key_len,
+                                     msg_opaque) != -1) {
+                        p->stats.tx++;
+                        p->stats.inflight_msgs++;
+                        p->stats.inflight_bytes += len;
                         break;
                 }
 
@@ -141,16 +417,170 @@ static void produce (void *buf, size_t len,
                         FATAL("Failed to produce message (%zd bytes): %s",
                               len, rd_kafka_err2str(err));
 
-                stats.tx_err_q++;
+                p->stats.tx_err_q++;
 
                 /* Internal queue full, sleep to allow
                  * messages to be produced/time out
                  * before trying again. */
-                rd_kafka_poll(conf.rk, 5);
+                rd_kafka_poll(p->rk, 5);
         } while (1);
 
         /* Poll for delivery reports, errors, etc. */
-        rd_kafka_poll(conf.rk, 0);
+        rd_kafka_poll(p->rk, 0);
+}
+
+
+/**
+ * Producer backpressure: if the in-flight high watermark (-W) has been
+ * reached, stop reading input and block on delivery report events
+ * until the number of in-flight messages and bytes has dropped
+ * to the low watermark (half of the high watermark).
+ * The watermarks apply to each producer instance.
+ */
+static void produce_backpressure (struct producer *p) {
+        if (!((conf.inflight_max_msgs &&
+               p->stats.inflight_msgs >= conf.inflight_max_msgs) ||
+              (conf.inflight_max_bytes &&
+               p->stats.inflight_bytes >= conf.inflight_max_bytes)))
+                return;
+
+        p->stats.tx_backpressure++;
+
+        while (conf.run &&
+               ((conf.inflight_max_msgs &&
+                 p->stats.inflight_msgs > conf.inflight_max_msgs / 2) ||
+                (conf.inflight_max_bytes &&
+                 p->stats.inflight_bytes > conf.inflight_max_bytes / 2)))
+                rd_kafka_poll(p->rk, 1000);
+}
+
+
+/**
+ * Add message to the current batch.
+ * The message memory must not be reused until the batch has been
+ * flushed with produce_batch_flush().
+ */
+static void produce_batch_add (struct producer *p, void *buf, size_t len,
+                               const void *key, size_t key_len,
+                               void *msg_opaque) {
+        rd_kafka_message_t *rkmessage = &p->batch.msgs[p->batch.cnt++];
+
+        memset(rkmessage, 0, sizeof(*rkmessage));
+        rkmessage->payload = buf;
+        rkmessage->len     = len;
+        rkmessage->key     = (void *)key;
+        rkmessage->key_len = key_len;
+        rkmessage->_private = msg_opaque;
+}
+
+
+/**
+ * Produces all messages in the current batch with rd_kafka_produce_batch(),
+ * re-submitting only the messages rejected due to queue congestion,
+ * and exits hard on other errors.
+ */
+static void produce_batch_flush (struct producer *p, int msgflags) {
+        rd_kafka_message_t *msgs = p->batch.msgs;
+        int cnt = p->batch.cnt;
+
+        while (cnt > 0) {
+                int i, good;
+                int retry_cnt = 0;
+
+                good = rd_kafka_produce_batch(p->rkt, p->batch.partition,
+                                              msgflags, msgs, cnt);
+                p->stats.tx += good;
+                p->stats.inflight_msgs += good;
+
+                /* Keep the rejected messages, in order, for retry. */
+                for (i = 0 ; i < cnt ; i++) {
+                        if (!msgs[i].err) {
+                                p->stats.inflight_bytes += msgs[i].len;
+                                continue;
+                        }
+
+                        if (msgs[i].err != RD_KAFKA_RESP_ERR__QUEUE_FULL)
+                                FATAL("Failed to produce message "
+                                      "(%zd bytes): %s",
+                                      msgs[i].len,
+                                      rd_kafka_err2str(msgs[i].err));
+
+                        msgs[retry_cnt] = msgs[i];
+                        msgs[retry_cnt].err = RD_KAFKA_RESP_ERR_NO_ERROR;
+                        retry_cnt++;
+                }
+                cnt = retry_cnt;
+
+                if (cnt == 0)
+                        break;
+
+                p->stats.tx_err_q++;
+
+                if (!conf.run)
+                        FATAL("Program terminated while "
+                              "producing batch of %i messages", cnt);
+
+                /* Internal queue full, sleep to allow
+                 * messages to be produced/time out
+                 * before trying again. */
+                rd_kafka_poll(p->rk, 5);
+        }
+
+        p->batch.cnt = 0;
+
+        /* Poll for delivery reports, errors, etc. */
+        rd_kafka_poll(p->rk, 0);
+}
+
+
+/**
+ * Produce the 'size' bytes of file 'path' at 'ptr' as chunk messages
+ * of at most conf.chunk_size bytes of data each (-S).
+ * All chunks of the file have the file id as key, so they are produced
+ * to the same partition.
+ */
+static void produce_chunks (struct producer *p, const char *path,
+                            const char *ptr, size_t size) {
+        struct chunk_hdr ch = { 0 };
+        char key[17];
+        uint64_t cnt;
+        size_t of;
+
+        cnt = (size + conf.chunk_size - 1) / conf.chunk_size;
+        if (cnt > UINT32_MAX)
+                FATAL("File %s needs too many chunks (%"PRIu64"): "
+                      "increase -S", path, cnt);
+
+        ch.file_id   = chunk_file_id(path, size);
+        ch.file_size = size;
+        ch.cnt       = (uint32_t)cnt;
+        ch.name      = path;
+        ch.name_len  = strlen(path) > UINT16_MAX ?
+                UINT16_MAX : strlen(path);
+
+        snprintf(key, sizeof(key), "%016"PRIx64, ch.file_id);
+
+        INFO(4, "Producing file %s (%zd bytes) in %"PRIu32" chunks\n",
+             path, size, ch.cnt);
+
+        for (of = 0 ; of < size ; of += conf.chunk_size, ch.idx++) {
+                size_t len = size - of < conf.chunk_size ?
+                        size - of : conf.chunk_size;
+                struct pool_buf *pb;
+                size_t msglen;
+
+                if (!conf.run)
+                        FATAL("Program terminated while producing "
+                              "chunk %"PRIu32"/%"PRIu32" of %s",
+                              ch.idx, ch.cnt, path);
+
+                pb = pool_get(KC_CHUNK_HDR_SIZE + ch.name_len + len);
+                msglen = chunk_encode(pb->data, &ch, ptr + of, len);
+
+                /* The chunk buffer is released in dr_msg_cb() */
+                produce(p, pb->data, msglen, key, sizeof(key)-1, 0, pb);
+                produce_backpressure(p);
+        }
 }
 
 
@@ -158,7 +588,7 @@ static void produce (void *buf, size_t len,
  * Produce contents of file as a single message.
  * Returns the file length on success, else -1.
  */
-static ssize_t produce_file (const char *path) {
+static ssize_t produce_file (struct producer *p, const char *path) {
         int fd;
         void *ptr;
         struct stat st;
@@ -168,264 +598,1227 @@ static ssize_t produce_file (const char *path) {
                 return -1;
         }
 
-        if (fstat(fd, &st) == -1) {
-                INFO(1, "Failed to stat %s: %s\n", path, strerror(errno));
-                close(fd);
-                return -1;
-        }
+        if (fstat(fd, &st) == -1) {
+                INFO(1, "Failed to stat %s: %s\n", path, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        if (st.st_size == 0) {
+                INFO(3, "Skipping empty file %s\n", path);
+                close(fd);
+                return 0;
+        }
+
+        ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+                INFO(1, "Failed to mmap %s: %s\n", path, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        if (conf.chunk_size > 0)
+                produce_chunks(p, path, ptr, st.st_size);
+        else {
+                INFO(4, "Producing file %s (%"PRIdMAX" bytes)\n",
+                     path, (intmax_t)st.st_size);
+                produce(p, ptr, st.st_size, NULL, 0,
+                        RD_KAFKA_MSG_F_COPY, NULL);
+        }
+
+        munmap(ptr, st.st_size);
+        return st.st_size;
+}
+
+
+/**
+ * Produce file 'f' prepared by the file queue as a single message.
+ * Returns the file length on success, else -1.
+ */
+static ssize_t produce_prepared_file (struct producer *p,
+                                      const struct kc_file *f) {
+        if (f->err) {
+                INFO(1, "Failed to %s %s: %s\n",
+                     f->err_op, f->path, strerror(f->err));
+                return -1;
+        }
+
+        if (f->size == 0) {
+                INFO(3, "Skipping empty file %s\n", f->path);
+                return 0;
+        }
+
+        if (conf.chunk_size > 0)
+                produce_chunks(p, f->path, f->ptr, f->size);
+        else {
+                INFO(4, "Producing file %s (%zd bytes)\n",
+                     f->path, f->size);
+                produce(p, f->ptr, f->size, NULL, 0,
+                        RD_KAFKA_MSG_F_COPY, NULL);
+        }
+
+        return f->size;
+}
+
+
+/**
+ * Produce each file in 'paths' as a single message.
+ * With -j files are opened and read ahead by a pool of worker threads,
+ * and directories are recursed into.
+ */
+static void produce_files (struct producer *p, char **paths, int pathcnt) {
+        int i;
+        int good = 0;
+        int cnt = pathcnt;
+
+        if (conf.file_threads > 0) {
+                struct fileq *fq;
+                struct kc_file f;
+
+                fq = fileq_new(paths, pathcnt, conf.file_threads);
+
+                while (conf.run && fileq_next(fq, &f)) {
+                        if (produce_prepared_file(p, &f) != -1)
+                                good++;
+                        fileq_release(fq, &f);
+                        produce_backpressure(p);
+                }
+
+                fileq_destroy(fq, &stats.files);
+                cnt = (int)(stats.files.files + stats.files.dir_errors);
+
+        } else {
+                for (i = 0 ; i < pathcnt ; i++) {
+                        if (produce_file(p, paths[i]) != -1)
+                                good++;
+                        produce_backpressure(p);
+                }
+        }
+
+        if (!good)
+                conf.exitcode = 1;
+        else if (good < cnt)
+                INFO(1, "Failed to produce from %i/%i files\n",
+                     cnt - good, cnt);
+}
+
+
+/**
+ * Wait for input on 'fd' to become readable, serving delivery reports
+ * and errors while waiting.
+ * With librdkafka queue IO events the wait is woken up by
+ * delivery reports, otherwise they are polled for periodically.
+ */
+static void producer_wait_input (struct producer *p, int fd) {
+        struct pollfd pfd[2];
+        int pfd_cnt = 1;
+
+        pfd[0].fd     = fd;
+        pfd[0].events = POLLIN;
+
+        if (p->dr_event_fds[0] != -1) {
+                pfd[1].fd     = p->dr_event_fds[0];
+                pfd[1].events = POLLIN;
+                pfd_cnt++;
+        }
+
+        while (conf.run) {
+                char tmp[64];
+                int r;
+
+                r = poll(pfd, pfd_cnt, pfd_cnt > 1 ? -1 : 50);
+                if (r == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        FATAL("Failed to poll input: %s", strerror(errno));
+                }
+
+                if (pfd_cnt > 1 && (pfd[1].revents & POLLIN)) {
+                        /* Drain the event pipe before serving the queue
+                         * so that no new event is missed. */
+                        while (read(p->dr_event_fds[0], tmp,
+                                    sizeof(tmp)) > 0)
+                                ;
+                }
+
+                rd_kafka_poll(p->rk, 0);
+
+                if (pfd[0].revents)
+                        break;
+        }
+}
+
+
+/**
+ * Get the next message to produce from input buffer 'ib', the input
+ * message is returned in 'msg' and the message to produce in 'pm'.
+ * If 'mf' is set the input buffer is the memory mapped file 'mf' and
+ * the message references the mapping, else the payload is copied
+ * from the reused input buffer to a pooled buffer.
+ * If 'copy_key' is set the key is copied to the same pooled buffer,
+ * which is needed when the message outlives the next inbuf_fill().
+ *
+ * Returns 1 if a message was returned in 'pm', 0 if more input
+ * is needed, or -1 on end of input.
+ */
+static int input_next (struct inbuf *ib, struct mapped_file *mf,
+                       int copy_key, struct inmsg *msg, struct prod_msg *pm) {
+        int r;
+
+        while ((r = inbuf_next(ib, msg)) == 1) {
+                pm->payload = msg->payload;
+                pm->len     = msg->len;
+                pm->key     = msg->key;
+                pm->key_len = msg->key_len;
+
+                if (!pm->key && pm->len == 0)
+                        continue;
+
+                if (pm->key && (conf.flags & CONF_F_NULL)) {
+                        if (pm->len == 0)
+                                pm->payload = NULL;
+                        if (pm->key_len == 0)
+                                pm->key = NULL;
+                }
+
+                if (mf) {
+                        /* Each message holds a reference to the mapping. */
+                        mapped_file_ref(mf);
+                        pm->opaque = mf;
+                } else if (pm->payload || (copy_key && pm->key)) {
+                        /* Input buffer is reused: copy payload */
+                        struct pool_buf *pb;
+
+                        pb = pool_get(pm->len +
+                                      (copy_key && pm->key ?
+                                       pm->key_len : 0));
+                        if (pm->payload) {
+                                memcpy(pb->data, pm->payload, pm->len);
+                                pm->payload = pb->data;
+                        }
+                        if (copy_key && pm->key) {
+                                memcpy(pb->data + pm->len, pm->key,
+                                       pm->key_len);
+                                pm->key = pb->data + pm->len;
+                        }
+                        pm->opaque = pb;
+                } else
+                        pm->opaque = NULL;
+
+                return 1;
+        }
+
+        return r;
+}
+
+
+/**
+ * Write input message 'msg' to stdout if tee mode (-T) is enabled.
+ */
+static void tee_msg (const struct inmsg *msg) {
+        if (conf.flags & CONF_F_TEE &&
+            fwrite(msg->raw, msg->raw_len, 1, stdout) != 1)
+                FATAL("Tee write error for message of %zd bytes: %s",
+                      msg->raw_len, strerror(errno));
+}
+
+
+/**
+ * Produce message 'pm', in a batch if batching is enabled (-B).
+ * The payload memory is owned by kafkacat and released in dr_msg_cb().
+ */
+static void produce_msg (struct producer *p, struct prod_msg *pm) {
+        if (p->batch.msgs) {
+                produce_batch_add(p, pm->payload, pm->len,
+                                  pm->key, pm->key_len, pm->opaque);
+                if (p->batch.cnt == conf.batch_size ||
+                    p->stats.tx + p->batch.cnt == conf.msg_cnt)
+                        produce_batch_flush(p, 0);
+        } else
+                produce(p, pm->payload, pm->len, pm->key, pm->key_len, 0,
+                        pm->opaque);
+
+        produce_backpressure(p);
+}
+
+
+/**
+ * Produce messages from input buffer 'ib' until end of input,
+ * or the program is terminated.
+ * See input_next() for 'mf'.
+ */
+static void produce_lines (struct producer *p, struct inbuf *ib,
+                           struct mapped_file *mf) {
+        struct inmsg msg;
+        struct prod_msg pm;
+        int r;
+
+        while (conf.run && (r = input_next(ib, mf, 0, &msg, &pm)) != -1) {
+                if (r == 0) {
+                        /* Need more input: batched keys
+                         * point to the input buffer and must
+                         * be produced before it is refilled. */
+                        if (p->batch.cnt > 0)
+                                produce_batch_flush(p, 0);
+
+                        producer_wait_input(p, ib->fd);
+
+                        if (inbuf_fill(ib) == -1 && errno != EINTR)
+                                FATAL("Unable to read message: %s",
+                                      strerror(errno));
+                        continue;
+                }
+
+                produce_msg(p, &pm);
+
+                tee_msg(&msg);
+
+                /* Enforce -c <cnt> */
+                if (p->stats.tx + p->batch.cnt == conf.msg_cnt)
+                        conf.run = 0;
+        }
+
+        if (p->batch.cnt > 0)
+                produce_batch_flush(p, 0);
+}
+
+
+
+/**
+ * Pipelined producer (-R, -N): the main thread reads and splits input
+ * into messages and passes them through a ring to each producer
+ * instance's thread.
+ */
+
+
+/**
+ * Returns the producer instance to produce message 'pm' on, where
+ * 'seq' is the message's input sequence number.
+ * With -K messages are sharded by key hash so that messages with the
+ * same key are produced in input order by the same instance.
+ * Messages to an explicit partition (-p) are sharded by partition,
+ * keeping their input order, else messages are spread evenly over the
+ * instances, without ordering.
+ */
+static struct producer *producer_shard (const struct prod_msg *pm,
+                                        uint64_t seq) {
+        uint32_t h = 2166136261u; /* FNV-1a */
+        size_t i;
+
+        if (conf.producer_cnt == 1)
+                return &producers[0];
+
+        if (!(conf.flags & CONF_F_KEY_DELIM) &&
+            conf.partition != RD_KAFKA_PARTITION_UA)
+                return &producers[conf.partition % conf.producer_cnt];
+
+        if (!(conf.flags & CONF_F_KEY_DELIM))
+                return &producers[seq % conf.producer_cnt];
+
+        for (i = 0 ; pm->key && i < pm->key_len ; i++)
+                h = (h ^ (unsigned char)pm->key[i]) * 16777619u;
+
+        return &producers[h % conf.producer_cnt];
+}
+
+
+/**
+ * Reader wait: wait for 'fd' to become readable,
+ * waking up periodically to check for termination.
+ * Returns 0 if the program was terminated.
+ */
+static int reader_wait (int fd, void *opaque) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        while (conf.run) {
+                int r = poll(&pfd, 1, 1000);
+
+                if (r == -1 && errno != EINTR)
+                        FATAL("Failed to poll input: %s", strerror(errno));
+                if (r > 0)
+                        break;
+        }
+
+        return conf.run;
+}
+
+
+/**
+ * Producer instance wait for its ring: flush the current batch and
+ * serve delivery reports while the reader catches up.
+ * Returns 0 if the program was terminated.
+ */
+static int producer_ring_wait (int fd, void *opaque) {
+        struct producer *p = opaque;
+
+        if (p->batch.cnt > 0)
+                produce_batch_flush(p, 0);
+
+        producer_wait_input(p, fd);
+
+        return conf.run;
+}
+
+
+/**
+ * Producer instance thread: produce messages from the instance's ring
+ * until the reader closes it.
+ */
+static void *producer_thread_main (void *arg) {
+        struct producer *p = arg;
+        struct prod_msg pm;
+
+        while (conf.run && ring_pop(p->ring, &pm, producer_ring_wait, p))
+                produce_msg(p, &pm);
+
+        if (p->batch.cnt > 0)
+                produce_batch_flush(p, 0);
+
+        return NULL;
+}
+
+
+/**
+ * Produce messages from input buffer 'ib' through a ring of
+ * conf.ring_depth messages to each producer instance's thread.
+ * See input_next() for 'mf'.
+ */
+static void produce_lines_pipelined (struct inbuf *ib,
+                                     struct mapped_file *mf) {
+        struct inmsg msg;
+        struct prod_msg pm;
+        uint64_t seq = 0;
+        int i, r;
+
+        /* Pooled buffers are taken by the reader and
+         * returned by the producer threads. */
+        pool_init(1);
+
+        for (i = 0 ; i < conf.producer_cnt ; i++) {
+                struct producer *p = &producers[i];
+
+                p->ring = ring_new(conf.ring_depth);
+
+                if ((r = pthread_create(&p->thrd, NULL,
+                                        producer_thread_main, p)))
+                        FATAL("Failed to create producer thread: %s",
+                              strerror(r));
+        }
+
+        while (conf.run &&
+               (r = input_next(ib, mf, 1, &msg, &pm)) != -1) {
+                if (r == 0) {
+                        if (!reader_wait(ib->fd, NULL))
+                                break;
+
+                        if (inbuf_fill(ib) == -1 && errno != EINTR)
+                                FATAL("Unable to read message: %s",
+                                      strerror(errno));
+                        continue;
+                }
+
+                if (!ring_push(producer_shard(&pm, seq)->ring, &pm,
+                               reader_wait, NULL)) {
+                        msg_opaque_release(pm.opaque);
+                        break;
+                }
+
+                tee_msg(&msg);
+
+                /* Enforce -c <cnt> */
+                if (++seq == (uint64_t)conf.msg_cnt)
+                        break;
+        }
+
+        for (i = 0 ; i < conf.producer_cnt ; i++)
+                ring_close(producers[i].ring);
+
+        for (i = 0 ; i < conf.producer_cnt ; i++) {
+                struct producer *p = &producers[i];
+                struct ring_stats *rs = &p->ring->stats;
+
+                pthread_join(p->thrd, NULL);
+
+                /* Release messages left in the ring on termination */
+                while (ring_pop(p->ring, &pm, producer_ring_wait, p))
+                        msg_opaque_release(pm.opaque);
+
+                p->stats.ring = *rs;
+                ring_destroy(p->ring);
+                p->ring = NULL;
+        }
+}
+
+
+/**
+ * Create producer instance 'p' from the rk and rkt configuration
+ * objects, which are consumed.
+ */
+static void producer_init (struct producer *p, rd_kafka_conf_t *rk_conf,
+                           rd_kafka_topic_conf_t *rkt_conf) {
+        char    errstr[512];
+
+        p->dr_event_fds[0] = p->dr_event_fds[1] = -1;
+
+        rd_kafka_conf_set_opaque(rk_conf, p);
+
+        /* Create producer */
+        if (!(p->rk = rd_kafka_new(RD_KAFKA_PRODUCER, rk_conf,
+                                   errstr, sizeof(errstr))))
+                FATAL("Failed to create producer: %s", errstr);
+
+        if (conf.debug)
+                rd_kafka_set_log_level(p->rk, LOG_DEBUG);
+        else if (conf.verbosity == 0)
+                rd_kafka_set_log_level(p->rk, 0);
+
+        /* Create topic */
+        if (!(p->rkt = rd_kafka_topic_new(p->rk, conf.topic, rkt_conf)))
+                FATAL("Failed to create topic %s: %s", conf.topic,
+                      rd_kafka_err2str(rd_kafka_errno2err(errno)));
+
+#if HAVE_RD_KAFKA_QUEUE_IO_EVENT
+        /* Have librdkafka signal the event pipe when delivery reports
+         * are available so the producer can wait on both input and
+         * delivery reports. */
+        if (pipe(p->dr_event_fds) == -1)
+                FATAL("Failed to create pipe: %s", strerror(errno));
+        fcntl(p->dr_event_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(p->dr_event_fds[1], F_SETFL, O_NONBLOCK);
+        {
+                rd_kafka_queue_t *rkqu = rd_kafka_queue_get_main(p->rk);
+                rd_kafka_queue_io_event_enable(rkqu, p->dr_event_fds[1],
+                                               "1", 1);
+                rd_kafka_queue_destroy(rkqu);
+        }
+#endif
+
+        if (conf.batch_size > 0) {
+                p->batch.partition = conf.partition;
+                p->batch.msgs = malloc(sizeof(*p->batch.msgs) *
+                                       conf.batch_size);
+                if (!p->batch.msgs)
+                        FATAL("Failed to allocate batch of %i messages",
+                              conf.batch_size);
+        }
+}
+
+
+/**
+ * Destroy producer instance 'p' and add its statistics to the totals.
+ */
+static void producer_destroy (struct producer *p) {
+        struct producer_stats *tx = &stats.tx;
+
+        rd_kafka_topic_destroy(p->rkt);
+        rd_kafka_destroy(p->rk);
+
+        if (p->dr_event_fds[0] != -1) {
+                close(p->dr_event_fds[0]);
+                close(p->dr_event_fds[1]);
+        }
+
+        if (p->batch.msgs)
+                free(p->batch.msgs);
+
+        tx->tx              += p->stats.tx;
+        tx->tx_err_q        += p->stats.tx_err_q;
+        tx->tx_err_dr       += p->stats.tx_err_dr;
+        tx->tx_delivered    += p->stats.tx_delivered;
+        tx->tx_backpressure += p->stats.tx_backpressure;
+
+        tx->ring.push_waits    += p->stats.ring.push_waits;
+        tx->ring.pop_waits     += p->stats.ring.pop_waits;
+        tx->ring.pops          += p->stats.ring.pops;
+        tx->ring.occupancy_sum += p->stats.ring.occupancy_sum;
+        if (p->stats.ring.occupancy_max > tx->ring.occupancy_max)
+                tx->ring.occupancy_max = p->stats.ring.occupancy_max;
+}
+
+
+/**
+ * Run producer, reading messages from 'fp' and producing to kafka.
+ * Or if 'pathcnt' is > 0, read messages from files in 'paths' instead.
+ */
+static void producer_run (FILE *fp, char **paths, int pathcnt) {
+        int i;
+
+        /* Assign per-message delivery report callback. */
+        rd_kafka_conf_set_dr_msg_cb(conf.rk_conf, dr_msg_cb);
+
+        /* Files are produced by a single instance */
+        if (pathcnt > 0 && !(conf.flags & CONF_F_LINE))
+                conf.producer_cnt = 1;
+
+        /* All chunks of a file are keyed by the file id and must be
+         * produced to the same partition. */
+        if (conf.chunk_size > 0)
+                rd_kafka_topic_conf_set_partitioner_cb(
+                        conf.rkt_conf, rd_kafka_msg_partitioner_consistent);
+
+        /* Chunks are reassembled in order, so retries must not reorder
+         * them: use the idempotent producer, or a single request in
+         * flight where that is not supported, unless set with -X. */
+        if (conf.chunk_size > 0 && !(conf.flags & CONF_F_ORDER_SET)) {
+                char errstr[512];
+
+                if (rd_kafka_conf_set(conf.rk_conf, "enable.idempotence",
+                                      "true", errstr, sizeof(errstr)) !=
+                    RD_KAFKA_CONF_OK &&
+                    rd_kafka_conf_set(conf.rk_conf,
+                                      "max.in.flight.requests.per.connection",
+                                      "1", errstr, sizeof(errstr)) !=
+                    RD_KAFKA_CONF_OK)
+                        FATAL("%s", errstr);
+        }
+
+        /* Create producer instances, each with its own copy
+         * of the configuration. */
+        producers = calloc(conf.producer_cnt, sizeof(*producers));
+        for (i = 0 ; i < conf.producer_cnt ; i++) {
+                if (i < conf.producer_cnt - 1)
+                        producer_init(&producers[i],
+                                      rd_kafka_conf_dup(conf.rk_conf),
+                                      rd_kafka_topic_conf_dup(conf.rkt_conf));
+                else
+                        producer_init(&producers[i],
+                                      conf.rk_conf, conf.rkt_conf);
+        }
+
+        conf.rk_conf  = NULL;
+        conf.rkt_conf = NULL;
+
+
+        if (pathcnt > 0 && !(conf.flags & CONF_F_LINE)) {
+                /* Read messages from files, each file is its own message. */
+                produce_files(&producers[0], paths, pathcnt);
+
+        } else {
+                /* Read messages from input, delimited by conf.delim */
+                struct mapped_file *mf = NULL;
+                struct inbuf ib;
+                int key_delim = (conf.flags & CONF_F_KEY_DELIM) ?
+                        conf.key_delim : -1;
+
+                /* Produce lines directly from a memory mapped file
+                 * if possible, else read input in blocks. */
+                if ((conf.flags & CONF_F_LINE) && pathcnt > 0 &&
+                    (mf = mapped_file_new(fp, paths[0])))
+                        inbuf_init_mem(&ib, mf->ptr, mf->size,
+                                       conf.delim, key_delim);
+                else
+                        inbuf_init(&ib, fileno(fp), KC_INBUF_SIZE,
+                                   conf.delim, key_delim);
+
+                if (conf.ring_depth > 0)
+                        produce_lines_pipelined(&ib, mf);
+                else
+                        produce_lines(&producers[0], &ib, mf);
+
+                inbuf_destroy(&ib);
+
+                /* Messages still in flight keep the mapping alive */
+                if (mf)
+                        mapped_file_unref(mf);
+        }
+
+        /* Wait for all messages to be transmitted */
+        conf.run = 1;
+        while (conf.run) {
+                int outq_len = 0;
+
+                for (i = 0 ; i < conf.producer_cnt ; i++)
+                        outq_len += rd_kafka_outq_len(producers[i].rk);
+
+                if (!outq_len)
+                        break;
+
+                for (i = 0 ; i < conf.producer_cnt ; i++)
+                        rd_kafka_poll(producers[i].rk, i == 0 ? 50 : 0);
+        }
+
+        for (i = 0 ; i < conf.producer_cnt ; i++)
+                producer_destroy(&producers[i]);
+
+        free(producers);
+        producers = NULL;
+
+        if (stats.tx.tx_err_q || stats.tx.tx_err_dr)
+                conf.exitcode = 1;
+}
+
+
+
+/**
+ * Consumer instance.
+ * The consumer normally runs a single instance on the main thread,
+ * with -N the topic's partitions are spread over multiple instances,
+ * each with its own handle and queue, that run in their own thread.
+ */
+struct consumer {
+        rd_kafka_t        *rk;
+        rd_kafka_topic_t  *rkt;
+        rd_kafka_queue_t  *rkqu;
+
+        int32_t           *partitions;   /* Partitions to consume */
+        int                partition_cnt;
+
+        int                fd;           /* Output fd */
+        struct output     *out;
+        pthread_t          thrd;
+
+        /* Offsets to store, see ostore_set() */
+        struct {
+                int64_t *offsets;    /* Indexed by partition, -1 if none */
+                int32_t *dirty;      /* Partitions with an offset to store */
+                int      dirty_cnt;
+        } ostore;
+
+        struct consumer_stats stats;
+};
+
+static struct consumer *consumers;
+
+/* Messages consumed by all instances, for -c */
+static int64_t consumed_cnt;
+
+/* Messages passing the filter in all instances, for -m */
+static int64_t matched_cnt;
+
+
+
+/**
+ * Consumer offsets to store, per partition.
+ *
+ * Offsets of output messages can only be stored once the output has
+ * written them: the offsets are collected here and stored each time
+ * the output is flushed, which it is at least every -U interval while
+ * output is pending, when idle, at partition EOF, and on termination.
+ */
+static void ostore_init (struct consumer *c, int partition_cnt) {
+        int i;
+
+        c->ostore.offsets = malloc(sizeof(*c->ostore.offsets) *
+                                   partition_cnt);
+        c->ostore.dirty   = malloc(sizeof(*c->ostore.dirty) * partition_cnt);
+        c->ostore.dirty_cnt = 0;
+
+        for (i = 0 ; i < partition_cnt ; i++)
+                c->ostore.offsets[i] = -1;
+}
+
+/**
+ * Set the offset to store for 'partition' once its output is written.
+ */
+static void ostore_set (struct consumer *c, int32_t partition,
+                        int64_t offset) {
+        if (c->ostore.offsets[partition] == -1)
+                c->ostore.dirty[c->ostore.dirty_cnt++] = partition;
+        c->ostore.offsets[partition] = offset;
+}
+
+/**
+ * Store the offsets set since the last call.
+ * Must only be called when all output has been written.
+ */
+static void ostore_commit (struct consumer *c) {
+        int i;
+
+        for (i = 0 ; i < c->ostore.dirty_cnt ; i++) {
+                int32_t partition = c->ostore.dirty[i];
+
+                rd_kafka_offset_store(c->rkt, partition,
+                                      c->ostore.offsets[partition]);
+                c->ostore.offsets[partition] = -1;
+        }
+
+        c->stats.offset_stores += c->ostore.dirty_cnt;
+        c->ostore.dirty_cnt = 0;
+}
+
+/**
+ * Output flush callback: the output has been written.
+ */
+static void ostore_flush_cb (void *opaque) {
+        ostore_commit(opaque);
+}
+
+static void ostore_term (struct consumer *c) {
+        free(c->ostore.offsets);
+        free(c->ostore.dirty);
+}
+
+
+/**
+ * Check message 'rkmessage' consumed by instance 'c': handle partition
+ * EOF, errors, the message count limit (-c), the key set (-k) and
+ * the filter (-g, -G, -m).
+ * The offset to store once the output of the messages consumed so far
+ * has been written is returned in '*offsetp', or -1.
+ *
+ * Returns 1 if the message should be output, else 0.
+ */
+static int consume_check (struct consumer *c, rd_kafka_message_t *rkmessage,
+                          int64_t *offsetp) {
+
+        *offsetp = -1;
+
+        if (!conf.run)
+                return 0;
+
+        if (rkmessage->err) {
+                if (rkmessage->err == RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+                        /* Store EOF offset.
+                         * If partition is empty and at offset 0,
+                         * store future first message (0). */
+                        *offsetp = rkmessage->offset == 0 ?
+                                0 : rkmessage->offset-1;
+                        if (conf.exit_eof) {
+                                /* Each partition is consumed by a single
+                                 * instance, but the count is shared. */
+                                if (!part_eof[rkmessage->partition]) {
+					/* Stop consuming this partition */
+					rd_kafka_consume_stop(rkmessage->rkt,
+							      rkmessage->partition);
+                                        part_eof[rkmessage->partition] = 1;
+                                        if (__atomic_add_fetch(
+                                                    &part_eof_cnt, 1,
+                                                    __ATOMIC_RELAXED) >=
+                                            part_eof_thres)
+                                                conf.run = 0;
+                                }
+
+                                INFO(1, "Reached end of topic %s [%"PRId32"] "
+                                     "at offset %"PRId64"%s\n",
+                                     rd_kafka_topic_name(rkmessage->rkt),
+                                     rkmessage->partition,
+                                     rkmessage->offset,
+                                     !conf.run ? ": exiting" : "");
+                        }
+                        return 0;
+                }
+
+                FATAL("Topic %s [%"PRId32"] error: %s",
+                      rd_kafka_topic_name(rkmessage->rkt),
+                      rkmessage->partition,
+                      rd_kafka_message_errstr(rkmessage));
+        }
+
+        if (conf.msg_cnt > 0) {
+                /* The limit applies to all instances: messages other
+                 * instances consumed past it are not output. */
+                int64_t cnt = __atomic_add_fetch(&consumed_cnt, 1,
+                                                 __ATOMIC_RELAXED);
+                if (cnt > conf.msg_cnt)
+                        return 0;
+                if (cnt == conf.msg_cnt)
+                        conf.run = 0;
+        }
+
+        *offsetp = rkmessage->offset;
+        c->stats.rx++;
+
+        /* Messages not passing the key set or filter are consumed
+         * but not output */
+        if (!keyset_match(rkmessage, &c->stats.keyset) ||
+            !filter_match(rkmessage, &c->stats.filter))
+                return 0;
+
+        if (conf.filter_max > 0) {
+                int64_t cnt = __atomic_add_fetch(&matched_cnt, 1,
+                                                 __ATOMIC_RELAXED);
+                if (cnt > conf.filter_max) {
+                        *offsetp = -1;
+                        return 0;
+                }
+                if (cnt == conf.filter_max)
+                        conf.run = 0;
+        }
+
+        return 1;
+}
+
+
+/**
+ * Consume callback, called for each message consumed.
+ */
+static void consume_cb (rd_kafka_message_t *rkmessage, void *opaque) {
+        struct consumer *c = opaque;
+        int64_t offset;
+
+        if (consume_check(c, rkmessage, &offset)) {
+                /* Analyze message, print it, or write it to its file */
+                if (conf.flags & CONF_F_ANALYZE) {
+                        if (conf.flags & CONF_F_SUMMARY)
+                                summary_msg(rkmessage);
+                        if (conf.topkeys_cnt > 0)
+                                topkeys_msg(rkmessage);
+                        if (conf.flags & CONF_F_HLL)
+                                hll_msg(rkmessage);
+                } else if (conf.reasm_dir)
+                        reasm_msg(rkmessage);
+                else
+                        fmt_msg_output(c->out, rkmessage);
+        }
+
+        if (offset != -1) {
+                ostore_set(c, rkmessage->partition, offset);
 
-        if (st.st_size == 0) {
-                INFO(3, "Skipping empty file %s\n", path);
-                close(fd);
-                return 0;
+                /* Have the EOF offset stored */
+                if (rkmessage->err)
+                        output_flush(c->out);
         }
+}
 
-        ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (ptr == MAP_FAILED) {
-                INFO(1, "Failed to mmap %s: %s\n", path, strerror(errno));
-                close(fd);
-                return -1;
-        }
 
-        INFO(4, "Producing file %s (%"PRIdMAX" bytes)\n",
-             path, (intmax_t)st.st_size);
-        produce(ptr, st.st_size, NULL, 0, RD_KAFKA_MSG_F_COPY);
+/**
+ * Consume a batch of 'cnt' messages.
+ */
+static void consume_batch (struct consumer *c,
+                           rd_kafka_message_t **msgs, ssize_t cnt) {
+        ssize_t i;
 
-        munmap(ptr, st.st_size);
-        return st.st_size;
+        for (i = 0 ; i < cnt ; i++) {
+                consume_cb(msgs[i], c);
+                output_msg_done(c->out, msgs[i]);
+        }
 }
 
 
 /**
- * Run producer, reading messages from 'fp' and producing to kafka.
- * Or if 'pathcnt' is > 0, read messages from files in 'paths' instead.
+ * Consume messages and format and write them on this thread.
  */
-static void producer_run (FILE *fp, char **paths, int pathcnt) {
-        char   *sbuf  = NULL;
-        size_t  size = 0;
-        ssize_t len;
-        char    errstr[512];
+static void consume_serial (struct consumer *c) {
+        struct output *out;
+        uint64_t polled = 0;
+        rd_kafka_message_t **msgs = NULL;
+
+        /* Instances writing to the same fd (-N) must not interleave */
+        if (conf.consumer_cnt > 1 && !conf.sink_prefix)
+                out = output_new_shared(c->fd);
+        else
+                out = output_new(c->fd);
+        out->flush_cb = ostore_flush_cb;
+        out->flush_opaque = c;
+        c->out = out;
+
+        if (conf.batch_size > 0 &&
+            !(msgs = malloc(sizeof(*msgs) * conf.batch_size)))
+                FATAL("Failed to allocate batch of %i messages",
+                      conf.batch_size);
+
+        /* Read messages from Kafka, write to the output.
+         * Pending output is flushed when there are no more messages
+         * to read. */
+        while (conf.run) {
+                int timeout_ms = out->iovcnt > 0 ? 0 : conf.batch_timeout_ms;
+                rd_kafka_message_t *rkmessage = NULL;
+                ssize_t cnt;
+
+                if (conf.batch_size > 0) {
+                        /* Batch consume (-B) */
+                        cnt = rd_kafka_consume_batch_queue(c->rkqu,
+                                                           timeout_ms,
+                                                           msgs,
+                                                           conf.batch_size);
+                        if (cnt == -1)
+                                FATAL("Failed to consume messages: %s",
+                                      rd_kafka_err2str(
+                                              rd_kafka_errno2err(errno)));
+
+                        if (cnt > 0) {
+                                c->stats.batches++;
+                                if ((uint64_t)cnt > c->stats.batch_max)
+                                        c->stats.batch_max = cnt;
+                                consume_batch(c, msgs, cnt);
+                        }
 
-        /* Assign per-message delivery report callback. */
-        rd_kafka_conf_set_dr_msg_cb(conf.rk_conf, dr_msg_cb);
+                } else {
+                        rkmessage = rd_kafka_consume_queue(c->rkqu,
+                                                           timeout_ms);
+                        cnt = rkmessage ? 1 : 0;
 
-        /* Create producer */
-        if (!(conf.rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf.rk_conf,
-                                     errstr, sizeof(errstr))))
-                FATAL("Failed to create producer: %s", errstr);
+                        if (rkmessage) {
+                                consume_cb(rkmessage, c);
+                                output_msg_done(out, rkmessage);
+                        }
+                }
 
-        if (conf.debug)
-                rd_kafka_set_log_level(conf.rk, LOG_DEBUG);
-        else if (conf.verbosity == 0)
-                rd_kafka_set_log_level(conf.rk, 0);
+                if (cnt == 0)
+                        output_flush(out);
+                else if (out->iovcnt == 0)
+                        ostore_commit(c); /* Nothing pending, e.g. -r */
 
-        /* Create topic */
-        if (!(conf.rkt = rd_kafka_topic_new(conf.rk, conf.topic,
-                                            conf.rkt_conf)))
-                FATAL("Failed to create topic %s: %s", conf.topic,
-                      rd_kafka_err2str(rd_kafka_errno2err(errno)));
+                /* Poll for errors, etc */
+                if (cnt == 0 || conf.batch_size > 0 ||
+                    c->stats.rx - polled >= 1000) {
+                        rd_kafka_poll(c->rk, 0);
+                        polled = c->stats.rx;
+
+                        /* Periodic top keys report (-H) */
+                        if (c == &consumers[0])
+                                topkeys_tick();
+                }
+        }
 
-        conf.rk_conf  = NULL;
-        conf.rkt_conf = NULL;
+        free(msgs);
 
+        output_flush(out);
+        c->stats.out = out->stats;
+        output_destroy(out);
+        c->out = NULL;
+}
 
-        if (pathcnt > 0 && !(conf.flags & CONF_F_LINE)) {
-                int i;
-                int good = 0;
-                /* Read messages from files, each file is its own message. */
 
-                for (i = 0 ; i < pathcnt ; i++)
-                        if (produce_file(paths[i]) != -1)
-                                good++;
+/**
+ * Formatting pipeline callback: the job's output has been written,
+ * store its offsets.
+ */
+static void consume_job_written_cb (struct fmt_job *job, void *opaque) {
+        struct consumer *c = opaque;
+        int i;
 
-                if (!good)
-                        conf.exitcode = 1;
-                else if (good < pathcnt)
-                        INFO(1, "Failed to produce from %i/%i files\n",
-                             pathcnt - good, pathcnt);
+        for (i = 0 ; i < job->offset_cnt ; i++)
+                ostore_set(c, job->offsets[i].partition,
+                           job->offsets[i].offset);
 
-        } else {
-                /* Read messages from input, delimited by conf.delim */
-                while (conf.run &&
-                       (len = getdelim(&sbuf, &size, conf.delim, fp)) != -1) {
-                        int msgflags = 0;
-                        char *buf = sbuf;
-                        char *key = NULL;
-                        size_t key_len = 0;
-                        size_t orig_len = len;
-
-                        if (len == 0)
-                                continue;
+        ostore_commit(c);
+}
 
-                        /* Shave off delimiter */
-                        if ((int)buf[len-1] == conf.delim)
-                                len--;
 
-                        if (len == 0)
-                                continue;
+/**
+ * Consume messages in batches and have them formatted by conf.fmt_threads
+ * formatter threads and written by the pipeline's writer (-j).
+ * In ordered mode each batch is a job, otherwise a batch is split into
+ * one job per formatter thread by partition.
+ */
+static void consume_pipelined (struct consumer *c) {
+        struct fmtpipe *pipe;
+        struct fmt_job **jobs;
+        rd_kafka_message_t **msgs;
+        int ordered = !(conf.flags & CONF_F_PART_ORDER);
+        int i;
 
-                        /* Extract key, if desired and found. */
-                        if (conf.flags & CONF_F_KEY_DELIM) {
-                                char *t;
-                                if ((t = memchr(buf, conf.key_delim, len))) {
-                                        key_len = (size_t)(t-sbuf);
-                                        key     = buf;
-                                        buf    += key_len+1;
-                                        len    -= key_len+1;
-
-                                        /* Since buf has been forwarded
-                                         * from its initial allocation point
-                                         * we must make sure we dont tell
-                                         * librdkafka to free it (since the
-                                         * address would be wrong). */
-                                        msgflags |= RD_KAFKA_MSG_F_COPY;
-
-                                        if (conf.flags & CONF_F_NULL) {
-                                                if (len == 0)
-                                                        buf = NULL;
-                                                if (key_len == 0)
-                                                        key = NULL;
-                                        }
-                                }
-                        }
+        pipe = fmtpipe_new(conf.fmt_threads, ordered, c->fd,
+                           consume_job_written_cb, c);
 
-                        if (!(msgflags & RD_KAFKA_MSG_F_COPY) &&
-                            len > 1024 && !(conf.flags & CONF_F_TEE)) {
-                                /* If message is larger than this arbitrary
-                                 * threshold it will be more effective to
-                                 * not copy the data but let rdkafka own it
-                                 * instead.
-                                 *
-                                 * Note that CONF_T_TEE must be checked,
-                                 * otherwise a possible race might occur.
-                                 * */
-                                msgflags |= RD_KAFKA_MSG_F_FREE;
-                        } else {
-                                /* For smaller messages a copy is
-                                 * more efficient. */
-                                msgflags |= RD_KAFKA_MSG_F_COPY;
-                        }
+        if (!(msgs = malloc(sizeof(*msgs) * conf.batch_size)))
+                FATAL("Failed to allocate batch of %i messages",
+                      conf.batch_size);
+        jobs = calloc(conf.fmt_threads, sizeof(*jobs));
+
+        while (conf.run) {
+                ssize_t cnt, j;
 
-                        /* Produce message */
-                        produce(buf, len, key, key_len, msgflags);
+                cnt = rd_kafka_consume_batch_queue(c->rkqu,
+                                                   conf.batch_timeout_ms,
+                                                   msgs, conf.batch_size);
+                if (cnt == -1)
+                        FATAL("Failed to consume messages: %s",
+                              rd_kafka_err2str(rd_kafka_errno2err(errno)));
 
-                        if (conf.flags & CONF_F_TEE &&
-                            fwrite(sbuf, orig_len, 1, stdout) != 1)
-                                FATAL("Tee write error for message of %zd bytes: %s",
-                                      orig_len, strerror(errno));
+                if (cnt > 0) {
+                        c->stats.batches++;
+                        if ((uint64_t)cnt > c->stats.batch_max)
+                                c->stats.batch_max = cnt;
+                }
 
-                        if (msgflags & RD_KAFKA_MSG_F_FREE) {
-                                /* rdkafka owns the allocated buffer
-                                 * memory now. */
-                                sbuf  = NULL;
-                                size = 0;
+                for (j = 0 ; j < cnt ; j++) {
+                        rd_kafka_message_t *rkmessage = msgs[j];
+                        struct fmt_job *job;
+                        int64_t offset;
+                        int output;
+                        int t = ordered ? 0 :
+                                rkmessage->partition % conf.fmt_threads;
+
+                        if (!(job = jobs[t]))
+                                job = jobs[t] = fmt_job_new(cnt);
+
+                        output = consume_check(c, rkmessage, &offset);
+
+                        if (offset != -1) {
+                                job->offsets[job->offset_cnt].partition =
+                                        rkmessage->partition;
+                                job->offsets[job->offset_cnt].offset =
+                                        offset;
+                                job->offset_cnt++;
                         }
 
-                        /* Enforce -c <cnt> */
-                        if (stats.tx == conf.msg_cnt)
-                                conf.run = 0;
+                        if (output)
+                                job->msgs[job->msg_cnt++] = rkmessage;
+                        else
+                                rd_kafka_message_destroy(rkmessage);
                 }
 
-                if (conf.run) {
-                        if (!feof(fp))
-                                FATAL("Unable to read message: %s",
-                                      strerror(errno));
+                for (i = 0 ; i < conf.fmt_threads ; i++) {
+                        if (jobs[i]) {
+                                fmtpipe_submit(pipe, jobs[i], i);
+                                jobs[i] = NULL;
+                        }
                 }
+
+                /* Poll for errors, etc */
+                rd_kafka_poll(c->rk, 0);
         }
 
-        /* Wait for all messages to be transmitted */
-        conf.run = 1;
-        while (conf.run && rd_kafka_outq_len(conf.rk))
-                rd_kafka_poll(conf.rk, 50);
+        fmtpipe_destroy(pipe, &stats.pipe);
+        c->stats.out = stats.pipe.out;
 
-        rd_kafka_topic_destroy(conf.rkt);
-        rd_kafka_destroy(conf.rk);
+        free(jobs);
+        free(msgs);
+}
 
-        if (sbuf)
-                free(sbuf);
 
-        if (stats.tx_err_q || stats.tx_err_dr)
-                conf.exitcode = 1;
+/**
+ * Consume with instance 'c' until done.
+ */
+static void consume (struct consumer *c) {
+        if (conf.fmt_threads > 0)
+                consume_pipelined(c); /* -j */
+        else
+                consume_serial(c);
 }
 
+static void *consumer_thread_main (void *arg) {
+        consume(arg);
+        return NULL;
+}
 
 
 /**
- * Consume callback, called for each message consumed.
+ * Create consumer instance 'c' from the rk and rkt configuration
+ * objects, which are consumed.
  */
-static void consume_cb (rd_kafka_message_t *rkmessage, void *opaque) {
-        FILE *fp = opaque;
+static void consumer_init (struct consumer *c, rd_kafka_conf_t *rk_conf,
+                           rd_kafka_topic_conf_t *rkt_conf) {
+        char    errstr[512];
 
-        if (!conf.run)
-                return;
+        rd_kafka_conf_set_opaque(rk_conf, c);
 
-        if (rkmessage->err) {
-                if (rkmessage->err == RD_KAFKA_RESP_ERR__PARTITION_EOF) {
-                        /* Store EOF offset.
-                         * If partition is empty and at offset 0,
-                         * store future first message (0). */
-                        rd_kafka_offset_store(rkmessage->rkt,
-                                              rkmessage->partition,
-                                              rkmessage->offset == 0 ?
-                                              0 : rkmessage->offset-1);
-                        if (conf.exit_eof) {
-                                if (!part_eof[rkmessage->partition]) {
-					/* Stop consuming this partition */
-					rd_kafka_consume_stop(rkmessage->rkt,
-							      rkmessage->partition);
-                                        part_eof[rkmessage->partition] = 1;
-                                        part_eof_cnt++;
-                                        if (part_eof_cnt >= part_eof_thres)
-                                                conf.run = 0;
-                                }
+        /* Create consumer */
+        if (!(c->rk = rd_kafka_new(RD_KAFKA_CONSUMER, rk_conf,
+                                   errstr, sizeof(errstr))))
+                FATAL("Failed to create consumer: %s", errstr);
 
-                                INFO(1, "Reached end of topic %s [%"PRId32"] "
-                                     "at offset %"PRId64"%s\n",
-                                     rd_kafka_topic_name(rkmessage->rkt),
-                                     rkmessage->partition,
-                                     rkmessage->offset,
-                                     !conf.run ? ": exiting" : "");
-                        }
-                        return;
-                }
+        if (conf.debug)
+                rd_kafka_set_log_level(c->rk, LOG_DEBUG);
+        else if (conf.verbosity == 0)
+                rd_kafka_set_log_level(c->rk, 0);
 
-                FATAL("Topic %s [%"PRId32"] error: %s",
-                      rd_kafka_topic_name(rkmessage->rkt),
-                      rkmessage->partition,
-                      rd_kafka_message_errstr(rkmessage));
+        /* Create topic */
+        if (!(c->rkt = rd_kafka_topic_new(c->rk, conf.topic, rkt_conf)))
+                FATAL("Failed to create topic %s: %s", conf.topic,
+                      rd_kafka_err2str(rd_kafka_errno2err(errno)));
+
+        /* Create a queue that combines messages from
+         * all of the instance's partitions. */
+        c->rkqu = rd_kafka_queue_new(c->rk);
+
+        c->fd = -1;
+}
+
+
+/**
+ * Start consuming the instance's partitions.
+ */
+static void consumer_start (struct consumer *c) {
+        int i;
+
+        for (i = 0 ; i < c->partition_cnt ; i++) {
+                int32_t partition = c->partitions[i];
+
+                if (rd_kafka_consume_start_queue(c->rkt, partition,
+                                                 conf.offset, c->rkqu) == -1)
+                        FATAL("Failed to start consuming "
+                              "topic %s [%"PRId32"]: %s",
+                              conf.topic, partition,
+                              rd_kafka_err2str(rd_kafka_errno2err(errno)));
         }
+}
+
 
-        /* Print message */
-        fmt_msg_output(fp, rkmessage);
+/**
+ * Stop and destroy consumer instance 'c' and add its statistics
+ * to the totals.
+ */
+static void consumer_destroy (struct consumer *c) {
+        struct consumer_stats *rx = &stats.rx;
+        int i;
+
+        /* Stop consuming */
+        for (i = 0 ; i < c->partition_cnt ; i++) {
+                int32_t partition = c->partitions[i];
+
+		/* Dont stop already stopped partitions */
+		if (!part_eof || !part_eof[partition])
+			rd_kafka_consume_stop(c->rkt, partition);
 
-        rd_kafka_offset_store(rkmessage->rkt,
-                              rkmessage->partition,
-                              rkmessage->offset);
+                rd_kafka_consume_stop(c->rkt, partition);
+        }
+
+        /* Destroy the instance's queue */
+        rd_kafka_queue_destroy(c->rkqu);
 
-        if (++stats.rx == conf.msg_cnt)
-                conf.run = 0;
+        /* Wait for outstanding requests to finish. */
+        conf.run = 1;
+        while (conf.run && rd_kafka_outq_len(c->rk) > 0)
+                rd_kafka_poll(c->rk, 50);
+
+        rd_kafka_topic_destroy(c->rkt);
+        rd_kafka_destroy(c->rk);
+
+        ostore_term(c);
+        free(c->partitions);
+
+        if (conf.sink_prefix && c->fd != -1)
+                close(c->fd);
+
+        if (c == &consumers[0] || c->stats.rx < stats.rx_min)
+                stats.rx_min = c->stats.rx;
+        if (c->stats.rx > stats.rx_max)
+                stats.rx_max = c->stats.rx;
+
+        rx->rx            += c->stats.rx;
+        rx->offset_stores += c->stats.offset_stores;
+        rx->batches       += c->stats.batches;
+        if (c->stats.batch_max > rx->batch_max)
+                rx->batch_max = c->stats.batch_max;
+
+        rx->filter.msgs          += c->stats.filter.msgs;
+        rx->filter.bytes         += c->stats.filter.bytes;
+        rx->filter.matched       += c->stats.filter.matched;
+        rx->filter.matched_bytes += c->stats.filter.matched_bytes;
+
+        rx->keyset.lookups      += c->stats.keyset.lookups;
+        rx->keyset.bloom_passed += c->stats.keyset.bloom_passed;
+        rx->keyset.matched      += c->stats.keyset.matched;
+
+        rx->out.writes        += c->stats.out.writes;
+        rx->out.bytes         += c->stats.out.bytes;
+        rx->out.copied        += c->stats.out.copied;
+        rx->out.referenced    += c->stats.out.referenced;
+        rx->out.timed_flushes += c->stats.out.timed_flushes;
 }
 
 
 /**
  * Run consumer, consuming messages from Kafka and writing to 'fp'.
+ * With -N the partitions are spread over conf.consumer_cnt instances,
+ * each writing to 'fp', or to its own file with -w.
  */
 static void consumer_run (FILE *fp) {
         char    errstr[512];
         rd_kafka_resp_err_t err;
         const rd_kafka_metadata_t *metadata;
+        int32_t *partitions;
+        int partition_cnt = 0;
         int i;
-        rd_kafka_queue_t *rkqu;
 
-        /* Create consumer */
-        if (!(conf.rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf.rk_conf,
-                                     errstr, sizeof(errstr))))
-                FATAL("Failed to create producer: %s", errstr);
+        if (conf.reasm_dir)
+                reasm_init(conf.reasm_dir);
 
-        if (conf.debug)
-                rd_kafka_set_log_level(conf.rk, LOG_DEBUG);
-        else if (conf.verbosity == 0)
-                rd_kafka_set_log_level(conf.rk, 0);
+        if (conf.keyset_path)
+                keyset_load(conf.keyset_path);
 
         /* The callback-based consumer API's offset store granularity is
          * not good enough for us, disable automatic offset store
@@ -435,33 +1828,30 @@ static void consumer_run (FILE *fp) {
                                     errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK)
                 FATAL("%s", errstr);
 
-        /* Create topic */
-        if (!(conf.rkt = rd_kafka_topic_new(conf.rk, conf.topic,
-                                            conf.rkt_conf)))
-                FATAL("Failed to create topic %s: %s", conf.topic,
-                      rd_kafka_err2str(rd_kafka_errno2err(errno)));
-
-        conf.rk_conf  = NULL;
-        conf.rkt_conf = NULL;
+        /* Create the first instance, used to query the topic,
+         * the others are created once their number is known. */
+        consumers = calloc(conf.consumer_cnt, sizeof(*consumers));
+        consumer_init(&consumers[0],
+                      rd_kafka_conf_dup(conf.rk_conf),
+                      rd_kafka_topic_conf_dup(conf.rkt_conf));
 
 
         /* Query broker for topic + partition information. */
-        if ((err = rd_kafka_metadata(conf.rk, 0, conf.rkt, &metadata, 5000)))
+        if ((err = rd_kafka_metadata(consumers[0].rk, 0, consumers[0].rkt,
+                                     &metadata, 5000)))
                 FATAL("Failed to query metadata for topic %s: %s",
-                      rd_kafka_topic_name(conf.rkt), rd_kafka_err2str(err));
+                      conf.topic, rd_kafka_err2str(err));
 
         /* Error handling */
         if (metadata->topic_cnt == 0)
-                FATAL("No such topic in cluster: %s",
-                      rd_kafka_topic_name(conf.rkt));
+                FATAL("No such topic in cluster: %s", conf.topic);
 
         if ((err = metadata->topics[0].err))
                 FATAL("Topic %s error: %s",
-                      rd_kafka_topic_name(conf.rkt), rd_kafka_err2str(err));
+                      conf.topic, rd_kafka_err2str(err));
 
         if (metadata->topics[0].partition_cnt == 0)
-                FATAL("Topic %s has no partitions",
-                      rd_kafka_topic_name(conf.rkt));
+                FATAL("Topic %s has no partitions", conf.topic);
 
         /* If Exit-at-EOF is enabled, set up array to track EOF
          * state for each partition. */
@@ -475,11 +1865,9 @@ static void consumer_run (FILE *fp) {
                         part_eof_thres = metadata->topics[0].partition_cnt;
         }
 
-        /* Create a shared queue that combines messages from
-         * all wanted partitions. */
-        rkqu = rd_kafka_queue_new(conf.rk);
-
-        /* Start consuming from all wanted partitions. */
+        /* Collect all wanted partitions. */
+        partitions = malloc(sizeof(*partitions) *
+                            metadata->topics[0].partition_cnt);
         for (i = 0 ; i < metadata->topics[0].partition_cnt ; i++) {
                 int32_t partition = metadata->topics[0].partitions[i].id;
 
@@ -488,62 +1876,118 @@ static void consumer_run (FILE *fp) {
                     conf.partition != partition)
                         continue;
 
-                /* Start consumer for this partition */
-                if (rd_kafka_consume_start_queue(conf.rkt, partition,
-                                                 conf.offset, rkqu) == -1)
-                        FATAL("Failed to start consuming "
-                              "topic %s [%"PRId32"]: %s",
-                              conf.topic, partition,
-                              rd_kafka_err2str(rd_kafka_errno2err(errno)));
-
-                if (conf.partition != RD_KAFKA_PARTITION_UA)
-                        break;
+                partitions[partition_cnt++] = partition;
         }
 
-        if (conf.partition != RD_KAFKA_PARTITION_UA &&
-            i == metadata->topics[0].partition_cnt)
+        if (conf.partition != RD_KAFKA_PARTITION_UA && partition_cnt == 0)
                 FATAL("Topic %s (with partitions 0..%i): "
                       "partition %i does not exist",
-                      rd_kafka_topic_name(conf.rkt),
+                      conf.topic,
                       metadata->topics[0].partition_cnt-1,
                       conf.partition);
 
+        /* No more instances than partitions */
+        if (conf.consumer_cnt > partition_cnt)
+                conf.consumer_cnt = partition_cnt;
+
+        /* Create the remaining instances, each with its own copy
+         * of the configuration, and spread the partitions over
+         * the instances. */
+        for (i = 0 ; i < conf.consumer_cnt ; i++) {
+                struct consumer *c = &consumers[i];
+
+                if (i > 0)
+                        consumer_init(c,
+                                      rd_kafka_conf_dup(conf.rk_conf),
+                                      rd_kafka_topic_conf_dup(conf.rkt_conf));
+
+                c->partitions = malloc(sizeof(*c->partitions) *
+                                       (partition_cnt /
+                                        conf.consumer_cnt + 1));
+                ostore_init(c, metadata->topics[0].partition_cnt);
+
+                if (conf.sink_prefix) {
+                        char path[1024];
+
+                        snprintf(path, sizeof(path), "%s%i",
+                                 conf.sink_prefix, i);
+                        if ((c->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC,
+                                          0644)) == -1)
+                                FATAL("Failed to open %s: %s",
+                                      path, strerror(errno));
+                } else
+                        c->fd = fileno(fp);
+        }
 
-        /* Read messages from Kafka, write to 'fp'. */
-        while (conf.run) {
-                rd_kafka_consume_callback_queue(rkqu, 100,
-                                                consume_cb, fp);
+        for (i = 0 ; i < partition_cnt ; i++) {
+                struct consumer *c = &consumers[i % conf.consumer_cnt];
+                c->partitions[c->partition_cnt++] = partitions[i];
+        }
 
-                /* Poll for errors, etc */
-                rd_kafka_poll(conf.rk, 0);
+        if (conf.flags & CONF_F_SUMMARY)
+                summary_init(metadata->topics[0].partition_cnt,
+                             partitions, partition_cnt);
+        if (conf.topkeys_cnt > 0)
+                topkeys_init(conf.topkeys_cnt, conf.topkeys_interval, fp,
+                             metadata->topics[0].partition_cnt,
+                             partitions, partition_cnt);
+        if (conf.flags & CONF_F_HLL)
+                hll_init(metadata->topics[0].partition_cnt,
+                         partitions, partition_cnt);
+
+        free(partitions);
+        rd_kafka_metadata_destroy(metadata);
+
+        rd_kafka_conf_destroy(conf.rk_conf);
+        rd_kafka_topic_conf_destroy(conf.rkt_conf);
+        conf.rk_conf  = NULL;
+        conf.rkt_conf = NULL;
+
+        /* Start consuming from all wanted partitions. */
+        for (i = 0 ; i < conf.consumer_cnt ; i++)
+                consumer_start(&consumers[i]);
+
+        /* Run the first instance on this thread and the others
+         * in their own threads. */
+        for (i = 1 ; i < conf.consumer_cnt ; i++) {
+                int r;
+                if ((r = pthread_create(&consumers[i].thrd, NULL,
+                                        consumer_thread_main,
+                                        &consumers[i])))
+                        FATAL("Failed to create consumer thread: %s",
+                              strerror(r));
         }
 
-        /* Stop consuming */
-        for (i = 0 ; i < metadata->topics[0].partition_cnt ; i++) {
-                int32_t partition = metadata->topics[0].partitions[i].id;
+        consume(&consumers[0]);
 
-                /* If -p <part> was specified: skip unwanted partitions */
-                if (conf.partition != RD_KAFKA_PARTITION_UA &&
-                    conf.partition != partition)
-                        continue;
+        for (i = 1 ; i < conf.consumer_cnt ; i++)
+                pthread_join(consumers[i].thrd, NULL);
 
-		/* Dont stop already stopped partitions */
-		if (!part_eof || !part_eof[partition])
-			rd_kafka_consume_stop(conf.rkt, partition);
+        for (i = 0 ; i < conf.consumer_cnt ; i++)
+                consumer_destroy(&consumers[i]);
 
-                rd_kafka_consume_stop(conf.rkt, partition);
+        free(consumers);
+        consumers = NULL;
+
+        if (conf.flags & CONF_F_SUMMARY) {
+                summary_print(fp);
+                summary_term();
         }
 
-        /* Destroy shared queue */
-        rd_kafka_queue_destroy(rkqu);
+        if (conf.topkeys_cnt > 0) {
+                topkeys_print();
+                topkeys_term();
+        }
 
-        /* Wait for outstanding requests to finish. */
-        conf.run = 1;
-        while (conf.run && rd_kafka_outq_len(conf.rk) > 0)
-                rd_kafka_poll(conf.rk, 50);
+        if (conf.flags & CONF_F_HLL) {
+                hll_print(fp);
+                if (conf.hll_path)
+                        hll_save(conf.hll_path);
+                hll_term();
+        }
 
-        rd_kafka_topic_destroy(conf.rkt);
-        rd_kafka_destroy(conf.rk);
+        if (conf.reasm_dir)
+                reasm_term();
 }
 
 
@@ -705,6 +2149,35 @@ static void __attribute__((noreturn)) usage (const char *argv0, int exitcode,
                "                     delimiter, as with stdin.\n"
                "                     (only one file allowed)\n"
                "  -T                 Output sent messages to stdout, acting like tee.\n"
+               "  -B <cnt>           Produce messages in batches of up to\n"
+               "                     <cnt> messages\n"
+               "  -W <cnt>[,<bytes>] Stop reading input when <cnt> messages\n"
+               "                     (or <bytes>) are awaiting delivery,\n"
+               "                     resume when half of them are delivered.\n"
+               "                     0 means no limit. Default: no limit\n"
+               "  -R <depth>         Read and split input in a separate\n"
+               "                     thread, queueing up to <depth>\n"
+               "                     messages for the producer\n"
+               "  -j <threads>       Open and read ahead files with this\n"
+               "                     many threads, recursing into directories.\n"
+               "                     Requires file arguments, without -l\n"
+               "  -S <bytes>         Produce files in chunks of <bytes> of\n"
+               "                     file data, each with a framing header\n"
+               "                     (see -r) of 36 bytes plus the file\n"
+               "                     path on top, so keep <bytes> below\n"
+               "                     message.max.bytes by that much.\n"
+               "                     Requires file arguments, without -l.\n"
+               "                     Enables enable.idempotence unless\n"
+               "                     set with -X, for in order delivery\n"
+               "  -N <instances>     Shard input over this many producer\n"
+               "                     instances, each in its own thread.\n"
+               "                     With -K messages are sharded by key,\n"
+               "                     with -p <partition> by partition,\n"
+               "                     keeping input order per key or\n"
+               "                     partition. Otherwise messages are\n"
+               "                     spread over the instances and input\n"
+               "                     order is not kept.\n"
+               "                     -W limits apply per instance\n"
                "  -c <cnt>           Exit after producing this number "
                "of messages\n"
                "  -Z                 Send empty messages as NULL messages\n"
@@ -724,6 +2197,9 @@ static void __attribute__((noreturn)) usage (const char *argv0, int exitcode,
                "                     Takes precedence over -D and -K.\n"
 #if ENABLE_JSON
                "  -J                 Output with JSON envelope\n"
+               "  -E                 With -J, embed payloads that are valid\n"
+               "                     JSON as JSON values instead of strings.\n"
+               "                     -EE also embeds keys\n"
 #endif
                "  -D <delim>         Delimiter to separate messages on output\n"
                "  -K <delim>         Print message keys prefixing the message\n"
@@ -733,7 +2209,54 @@ static void __attribute__((noreturn)) usage (const char *argv0, int exitcode,
                "of messages\n"
                "  -Z                 Print NULL messages and keys as \"%s\""
                "(instead of empty)\n"
-               "  -u                 Unbuffered output\n"
+               "  -B <cnt>[,<ms>]    Consume messages in batches of up to\n"
+               "                     <cnt> messages, waiting at most <ms>\n"
+               "                     milliseconds for a batch (default 100)\n"
+               "  -j <threads>[,p]   Format messages with this many threads,\n"
+               "                     in batches (-B, default %i).\n"
+               "                     Output is in consumed order, or with\n"
+               "                     ',p' only in order per partition\n"
+               "  -u                 Unbuffered output (not with -j)\n"
+               "  -U <ms>            Write buffered output at most <ms>\n"
+               "                     milliseconds after it was formatted,\n"
+               "                     0 to only write when idle or full\n"
+               "                     (default %i)\n"
+               "  -r <dir>           Write files produced with -S to <dir>\n"
+               "  -N <instances>     Spread the partitions over this many\n"
+               "                     consumer instances, each in its own\n"
+               "                     thread. -c and -e apply to all\n"
+               "  -w <prefix>        Write each instance's output to its own\n"
+               "                     file <prefix><instance> instead of\n"
+               "                     stdout\n"
+               "  -g <string>        Only output messages containing <string>\n"
+               "  -G <regex>         Only output messages matching extended\n"
+               "                     regular expression <regex>.\n"
+               "                     -g and -G may be given multiple times,\n"
+               "                     a message matching any is output\n"
+               "  -F k|s|ks          Match -g and -G against the key,\n"
+               "                     payload or both. Default: s\n"
+               "  -V                 Only output messages NOT matching\n"
+               "  -m <cnt>           Exit after outputting this number of\n"
+               "                     matching messages\n"
+               "  -k <file>          Only output messages with a key listed\n"
+               "                     in <file>, one key per line\n"
+               "  -s                 Print a per partition summary of the\n"
+               "                     consumed messages on exit instead of\n"
+               "                     the messages, as JSON with -J\n"
+               "  -H <cnt>[,<s>]     Print the <cnt> most frequent keys, by\n"
+               "                     messages and bytes, per partition and\n"
+               "                     in total on exit, and every <s>\n"
+               "                     seconds, instead of the messages.\n"
+               "                     Counts are estimates, overestimated by\n"
+               "                     at most the reported error.\n"
+               "                     <cnt> is at most %i\n"
+               "  -a                 Print the estimated number of distinct\n"
+               "                     keys per partition and in total on\n"
+               "                     exit instead of the messages\n"
+               "  -A <file>          Also save the -a key sketches to <file>\n"
+               "  -M <file>          Merge key sketches from <file>, saved\n"
+               "                     with -A by other runs or hosts, into\n"
+               "                     those of -a. May be given multiple times\n"
                "\n"
                "Metadata options:\n"
                "  -t <topic>         Topic to query (optional)\n"
@@ -747,6 +2270,9 @@ static void __attribute__((noreturn)) usage (const char *argv0, int exitcode,
                "  %%t                 Topic\n"
                "  %%p                 Partition\n"
                "  %%o                 Message offset\n"
+               "  %%{json:<path>}     JSON value at <path> in payload\n"
+               "                     (-Z null string if absent),\n"
+               "                     e.g.: $.user.id or items[0][\"a b\"]\n"
                "  \\n \\r \\t           Newlines, tab\n"
                "  \\xXX \\xNNN         Any ASCII character\n"
                " Example:\n"
@@ -773,7 +2299,8 @@ static void __attribute__((noreturn)) usage (const char *argv0, int exitcode,
                "",
 #endif
                rd_kafka_version_str(),
-               conf.null_str
+               conf.null_str, KC_FMTPIPE_BATCH, KC_FLUSH_MS,
+               KC_TOPK_MAX
                 );
         exit(exitcode);
 }
@@ -818,6 +2345,35 @@ static int parse_delim (const char *str) {
         return delim;
 }
 
+
+/**
+ * Parse the number 'str' given to option -'opt', failing with usage()
+ * unless it is within 'min'..'max'.
+ * If 'endp' is set the number may be followed by ',' and more of the
+ * option's value, at '*endp', else it must be all of 'str'.
+ */
+static int64_t parse_num (const char *argv0, char opt, const char *str,
+                          int64_t min, int64_t max, char **endp) {
+        char *end;
+        long long v;
+
+        errno = 0;
+        v = strtoll(str, &end, 10);
+        if (end == str || errno == ERANGE || v < min || v > max ||
+            (*end && (!endp || *end != ','))) {
+                char reason[128];
+                snprintf(reason, sizeof(reason),
+                         "-%c expects a number in the range "
+                         "%"PRId64"..%"PRId64": %s", opt, min, max, str);
+                usage(argv0, 1, reason);
+        }
+
+        if (endp)
+                *endp = end;
+
+        return (int64_t)v;
+}
+
 /**
  * Parse command line arguments
  */
@@ -830,9 +2386,10 @@ static void argparse (int argc, char **argv) {
         char tmp_fmt[64];
 
         while ((opt = getopt(argc, argv,
-                             "PCLt:p:b:z:o:eD:K:Od:qvX:c:Tuf:Zl"
+                             "PCLt:p:b:z:o:eD:K:Od:qvX:c:Tuf:ZlB:W:R:N:j:S:r:U:w:"
+                             "g:G:F:Vm:k:sH:aA:M:"
 #if ENABLE_JSON
-                             "J"
+                             "JE"
 #endif
                         )) != -1) {
                 switch (opt) {
@@ -880,6 +2437,12 @@ static void argparse (int argc, char **argv) {
                 case 'J':
                         conf.flags |= CONF_F_FMT_JSON;
                         break;
+                case 'E':
+                        /* -E: payloads, -EE: also keys */
+                        if (conf.flags & CONF_F_JSON_RAW)
+                                conf.flags |= CONF_F_JSON_RAW_KEY;
+                        conf.flags |= CONF_F_JSON_RAW;
+                        break;
 #endif
                 case 'D':
                         delim = optarg;
@@ -891,6 +2454,124 @@ static void argparse (int argc, char **argv) {
                 case 'l':
                         conf.flags |= CONF_F_LINE;
                         break;
+                case 'B':
+                {
+                        char *end;
+                        conf.batch_size =
+                                (int)parse_num(argv[0], 'B', optarg,
+                                               1, KC_BATCH_MAX, &end);
+                        if (*end == ',')
+                                conf.batch_timeout_ms =
+                                        (int)parse_num(argv[0], 'B', end+1,
+                                                       0, INT_MAX, NULL);
+                }
+                break;
+                case 'W':
+                {
+                        char *end;
+                        /* 0 means no limit */
+                        conf.inflight_max_msgs =
+                                (int)parse_num(argv[0], 'W', optarg,
+                                               0, INT_MAX, &end);
+                        if (*end == ',')
+                                conf.inflight_max_bytes =
+                                        parse_num(argv[0], 'W', end+1,
+                                                  0, INT64_MAX, NULL);
+                }
+                break;
+                case 'R':
+                        conf.ring_depth =
+                                (int)parse_num(argv[0], 'R', optarg,
+                                               1, KC_RING_DEPTH_MAX, NULL);
+                        break;
+                case 'N':
+                        conf.producer_cnt = conf.consumer_cnt =
+                                (int)parse_num(argv[0], 'N', optarg,
+                                               1, KC_INSTANCES_MAX, NULL);
+                        break;
+                case 'w':
+                        conf.sink_prefix = optarg;
+                        break;
+                case 'g':
+                case 'G':
+                        filter_add(optarg, opt == 'G');
+                        break;
+                case 'F':
+                        if (!strcmp(optarg, "k"))
+                                conf.filter_fields = KC_FILTER_KEY;
+                        else if (!strcmp(optarg, "s"))
+                                conf.filter_fields = KC_FILTER_PAYLOAD;
+                        else if (!strcmp(optarg, "ks") ||
+                                 !strcmp(optarg, "sk"))
+                                conf.filter_fields = KC_FILTER_KEY|
+                                        KC_FILTER_PAYLOAD;
+                        else
+                                usage(argv[0], 1,
+                                      "-F expects k, s or ks");
+                        break;
+                case 'V':
+                        conf.flags |= CONF_F_FILTER_INVERT;
+                        break;
+                case 'm':
+                        conf.filter_max = parse_num(argv[0], 'm', optarg,
+                                                    1, INT64_MAX, NULL);
+                        break;
+                case 'k':
+                        conf.keyset_path = optarg;
+                        break;
+                case 's':
+                        conf.flags |= CONF_F_SUMMARY|CONF_F_ANALYZE;
+                        break;
+                case 'H':
+                {
+                        char *end;
+                        conf.topkeys_cnt =
+                                (int)parse_num(argv[0], 'H', optarg,
+                                               1, KC_TOPK_MAX, &end);
+                        if (*end == ',')
+                                conf.topkeys_interval =
+                                        (int)parse_num(argv[0], 'H', end+1,
+                                                       1, INT32_MAX, NULL);
+                        conf.flags |= CONF_F_ANALYZE;
+                }
+                break;
+                case 'A':
+                        conf.hll_path = optarg;
+                        /* FALLTHRU */
+                case 'a':
+                        conf.flags |= CONF_F_HLL|CONF_F_ANALYZE;
+                        break;
+                case 'M':
+                        hll_merge_add(optarg);
+                        conf.flags |= CONF_F_HLL|CONF_F_ANALYZE;
+                        break;
+                case 'j':
+                {
+                        /* Producer file readers, or consumer formatters */
+                        char *end;
+                        conf.file_threads = conf.fmt_threads =
+                                (int)parse_num(argv[0], 'j', optarg,
+                                               1, KC_INSTANCES_MAX, &end);
+                        if (!strcmp(end, ",p"))
+                                conf.flags |= CONF_F_PART_ORDER;
+                        else if (*end)
+                                usage(argv[0], 1,
+                                      "-j expects <threads>[,p]");
+                }
+                break;
+                case 'S':
+                        conf.chunk_size =
+                                (size_t)parse_num(argv[0], 'S', optarg,
+                                                  1, INT32_MAX, NULL);
+                        break;
+                case 'r':
+                        conf.reasm_dir = optarg;
+                        break;
+                case 'U':
+                        conf.flush_ms =
+                                (int)parse_num(argv[0], 'U', optarg,
+                                               0, INT_MAX, NULL);
+                        break;
                 case 'O':
                         conf.flags |= CONF_F_OFFSET;
                         break;
@@ -918,6 +2599,7 @@ static void argparse (int argc, char **argv) {
                         conf.flags |= CONF_F_TEE;
                         break;
                 case 'u':
+                        conf.flags |= CONF_F_UNBUF;
                         setbuf(stdout, NULL);
                         break;
                 case 'X':
@@ -966,6 +2648,11 @@ static void argparse (int argc, char **argv) {
 
                         if (res != RD_KAFKA_CONF_OK)
                                 FATAL("%s", errstr);
+
+                        if (!strcmp(name, "enable.idempotence") ||
+                            !strncmp(name, "max.in.flight",
+                                     strlen("max.in.flight")))
+                                conf.flags |= CONF_F_ORDER_SET;
                 }
                 break;
 
@@ -1023,10 +2710,50 @@ static void argparse (int argc, char **argv) {
 
                 fmt_parse(fmt);
 
+                filter_init();
+
+                if ((conf.flags & CONF_F_JSON_RAW) &&
+                    !(conf.flags & CONF_F_FMT_JSON))
+                        usage(argv[0], 1, "-E requires -J");
+
+                if (conf.flags & CONF_F_ANALYZE) {
+                        if (conf.fmt_threads > 0)
+                                usage(argv[0], 1, "-s/-H/-a and -j are "
+                                      "mutually exclusive");
+                        if (conf.reasm_dir)
+                                usage(argv[0], 1, "-s/-H/-a and -r are "
+                                      "mutually exclusive");
+                }
+
+                if (conf.fmt_threads > 0) {
+                        if (conf.reasm_dir)
+                                usage(argv[0], 1,
+                                      "-j and -r are mutually exclusive");
+                        /* Output is written per formatted batch */
+                        if (conf.flags & CONF_F_UNBUF)
+                                usage(argv[0], 1,
+                                      "-j and -u are mutually exclusive");
+                        if (conf.batch_size <= 0)
+                                conf.batch_size = KC_FMTPIPE_BATCH;
+                }
+
+                if (conf.consumer_cnt > 1) {
+                        if (conf.fmt_threads > 0)
+                                usage(argv[0], 1,
+                                      "-j and -N are mutually exclusive");
+                        if (conf.reasm_dir)
+                                usage(argv[0], 1,
+                                      "-N and -r are mutually exclusive");
+                }
+
         } else if (conf.mode == 'P') {
                 conf.delim = parse_delim(delim);
 		if (conf.flags & CONF_F_KEY_DELIM)
 			conf.key_delim = parse_delim(key_delim);
+
+                /* Multiple instances are fed by the reader through rings */
+                if (conf.producer_cnt > 1 && conf.ring_depth <= 0)
+                        conf.ring_depth = KC_RING_DEPTH;
         }
 }
 
@@ -1090,6 +2817,21 @@ int main (int argc, char **argv) {
                 exit(0);
         }
 
+        if (conf.chunk_size > 0 &&
+            (conf.mode != 'P' || optind >= argc ||
+             (conf.flags & CONF_F_LINE)))
+                usage(argv[0], 1, "-S requires file arguments, without -l");
+
+        /* Producer -j reads ahead files produced whole */
+        if (conf.mode == 'P' && conf.file_threads > 0) {
+                if (optind >= argc || (conf.flags & CONF_F_LINE))
+                        usage(argv[0], 1,
+                              "-j requires file arguments, without -l");
+                if (conf.flags & CONF_F_PART_ORDER)
+                        usage(argv[0], 1,
+                              "-j ,p only applies to the consumer");
+        }
+
         if (optind < argc) {
                 if (conf.mode != 'P')
                         usage(argv[0], 1,
@@ -1129,7 +2871,12 @@ int main (int argc, char **argv) {
 
         rd_kafka_wait_destroyed(5000);
 
+        stats_print();
+
         fmt_term();
+        filter_term();
+        keyset_term();
+        pool_term();
 
         exit(conf.exitcode);
 }
@@ -27,10 +27,14 @@
  */
 #pragma once
 
+#include <stdio.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include <librdkafka/rdkafka.h>
 
@@ -46,10 +50,19 @@ typedef enum {
         KC_FMT_PAYLOAD_LEN,
         KC_FMT_TOPIC,
         KC_FMT_PARTITION,
+        KC_FMT_JSON,
 } fmt_type_t;
 
 #define KC_FMT_MAX_SIZE  128
 
+#define KC_INBUF_SIZE    (4*1024*1024) /* Producer input block size */
+#define KC_RING_DEPTH    1024          /* Default ring depth with -N */
+#define KC_BATCH_MAX     1000000       /* Max -B batch size */
+#define KC_RING_DEPTH_MAX (1 << 24)    /* Max -R ring depth */
+#define KC_INSTANCES_MAX 1024          /* Max -N instances */
+#define KC_FILEQ_WINDOW  16            /* Files read ahead per -j thread */
+#define KC_FLUSH_MS      100           /* Consumer output flush interval */
+
 struct conf {
         int     run;
         int     verbosity;
@@ -62,6 +75,17 @@ struct conf {
 #define CONF_F_TEE        0x8 /* Tee output when producing */
 #define CONF_F_NULL       0x10 /* Send empty messages as NULL */
 #define CONF_F_LINE	  0x20 /* Read files in line mode when producing */
+#define CONF_F_UNBUF      0x40 /* Consumer: flush output after each message */
+#define CONF_F_PART_ORDER 0x80 /* Consumer: -j output ordered per partition */
+#define CONF_F_JSON_RAW   0x100 /* Consumer: embed JSON payloads as is */
+#define CONF_F_JSON_RAW_KEY 0x200 /* Consumer: embed JSON keys as is */
+#define CONF_F_FILTER_INVERT 0x400 /* Consumer: output non-matching messages */
+#define CONF_F_SUMMARY    0x800 /* Consumer: print summary instead of messages */
+#define CONF_F_ANALYZE    0x1000 /* Consumer: analyze messages (-s, -H, -a)
+                                  * instead of outputting them */
+#define CONF_F_HLL        0x2000 /* Consumer: estimate distinct keys */
+#define CONF_F_ORDER_SET  0x4000 /* Producer: idempotence or in-flight
+                                  * requests set with -X */
         int     delim;
         int     key_delim;
 
@@ -69,9 +93,23 @@ struct conf {
                 fmt_type_t type;
                 const char *str;
                 int         str_len;
+                struct json_path *json_path; /* KC_FMT_JSON */
         } fmt[KC_FMT_MAX_SIZE];
         int     fmt_cnt;
         int     msg_size;
+        int     batch_size;
+        int     batch_timeout_ms;  /* Consumer batch timeout (-B) */
+        int     inflight_max_msgs;
+        int64_t inflight_max_bytes;
+        int     ring_depth;
+        int     producer_cnt;
+        int     consumer_cnt;
+        int     file_threads;
+        int     fmt_threads;
+        size_t  chunk_size;
+        char   *reasm_dir;
+        char   *sink_prefix;       /* Consumer: per-instance output files */
+        int     flush_ms;
         char   *brokers;
         char   *topic;
         int32_t partition;
@@ -80,6 +118,14 @@ struct conf {
         int64_t msg_cnt;
         char   *null_str;
         int     null_str_len;
+        int     filter_fields;     /* Consumer: fields to filter (-F) */
+#define KC_FILTER_KEY     0x1
+#define KC_FILTER_PAYLOAD 0x2
+        int64_t filter_max;        /* Consumer: matches to output (-m) */
+        char   *keyset_path;       /* Consumer: key file (-k) */
+        int     topkeys_cnt;       /* Consumer: top keys to report (-H) */
+        int     topkeys_interval;  /* Consumer: -H report interval (s) */
+        char   *hll_path;          /* Consumer: key sketch file (-A) */
 
         rd_kafka_conf_t       *rk_conf;
         rd_kafka_topic_conf_t *rkt_conf;
@@ -107,10 +153,13 @@ void __attribute__((noreturn)) fatal0 (const char *func, int line,
 
 
 
+struct output;
+
 /*
  * format.c
  */
-void fmt_msg_output (FILE *fp, const rd_kafka_message_t *rkmessage);
+void fmt_msg_output (struct output *out, const rd_kafka_message_t *rkmessage);
+void fmt_write_int (struct output *out, int64_t v);
 
 void fmt_parse (const char *fmt);
 
@@ -119,12 +168,482 @@ void fmt_term (void);
 
 
 
+/*
+ * input.c
+ */
+struct inmsg {
+        char   *raw;      /* Message including key and delimiter */
+        size_t  raw_len;
+        char   *key;      /* Key, or NULL if no key delimiter was found */
+        size_t  key_len;
+        char   *payload;
+        size_t  len;
+};
+
+struct inbuf {
+        int     fd;
+        char   *buf;
+        size_t  size;     /* Allocated size of buf */
+        size_t  len;      /* Bytes of input in buf */
+        size_t  of;       /* Start of next message */
+        size_t  scan;     /* Scan position of next message */
+        ssize_t key_of;   /* Key delimiter position of next message, or -1 */
+        int     eof;
+        int     delim;
+        int     key_delim;
+        const char *(*scan2) (const char *s, const char *end, int c1, int c2);
+};
+
+void inbuf_init (struct inbuf *ib, int fd, size_t size,
+                 int delim, int key_delim);
+void inbuf_init_mem (struct inbuf *ib, char *ptr, size_t size,
+                     int delim, int key_delim);
+void inbuf_destroy (struct inbuf *ib);
+ssize_t inbuf_fill (struct inbuf *ib);
+int inbuf_next (struct inbuf *ib, struct inmsg *msg);
+
+
+
+/*
+ * pool.c
+ */
+
+/**
+ * Owner of a produced message's payload memory, referenced by
+ * the message opaque and released from the delivery report callback.
+ */
+typedef enum {
+        KC_MSG_OWNER_MAPPED_FILE, /* struct mapped_file */
+        KC_MSG_OWNER_POOL,        /* struct pool_buf */
+} kc_msg_owner_t;
+
+struct pool_buf {
+        kc_msg_owner_t   owner;
+        int              cls;     /* Size class, or -1 if not pooled */
+        size_t           size;    /* Usable size of data */
+        struct pool_buf *next;    /* Free list link */
+        char             data[];
+};
+
+struct pool_stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t bytes_resident;
+};
+
+extern struct pool_stats pool_stats;
+
+void pool_init (int threaded);
+struct pool_buf *pool_get (size_t size);
+void pool_put (struct pool_buf *pb);
+void pool_term (void);
+
+
+
+/*
+ * ring.c
+ */
+
+/**
+ * Producer message descriptor passed from the reader thread
+ * to the produce thread.
+ */
+struct prod_msg {
+        char   *payload;
+        size_t  len;
+        char   *key;
+        size_t  key_len;
+        void   *opaque;   /* Payload owner, see kc_msg_owner_t */
+};
+
+struct ring_stats {
+        uint64_t push_waits;     /* Ring full: pusher waited */
+        uint64_t pop_waits;      /* Ring empty: popper waited */
+        uint64_t pops;
+        uint64_t occupancy_sum;  /* Sum of occupancy at each pop */
+        uint64_t occupancy_max;
+};
+
+struct ring {
+        struct prod_msg *slots;
+        size_t           mask;
+
+        /* Written by the push side */
+        size_t  head __attribute__((aligned(64)));
+        int     push_waiting;
+        int     closed;
+
+        /* Written by the pop side */
+        size_t  tail __attribute__((aligned(64)));
+        int     pop_waiting;
+        struct ring_stats stats;
+
+        int     pop_fds[2];      /* Wakes up the pop side */
+        int     push_fds[2];     /* Wakes up the push side */
+};
+
+struct ring *ring_new (int depth);
+void ring_destroy (struct ring *ring);
+int ring_push (struct ring *ring, const struct prod_msg *pm,
+               int (*wait_cb) (int fd, void *opaque),
+               void *opaque);
+int ring_pop (struct ring *ring, struct prod_msg *pm,
+              int (*wait_cb) (int fd, void *opaque),
+              void *opaque);
+void ring_close (struct ring *ring);
+
+
+
+/*
+ * files.c
+ */
+struct kc_file {
+        char       *path;
+        char       *ptr;      /* Mapped file, or NULL if empty or failed */
+        size_t      size;
+        const char *err_op;   /* Failed operation, if err is set */
+        int         err;      /* errno */
+        int         ready;    /* Prepared by a worker */
+};
+
+struct fileq_stats {
+        uint64_t files;       /* Files in the list */
+        uint64_t dir_errors;  /* Directories that could not be read */
+        uint64_t waits;       /* Producer waited for the next file */
+};
+
+struct fileq {
+        struct kc_file *files;
+        int             cnt;
+        int             size;
+
+        char          **paths;      /* Files and directories to walk */
+        int             pathcnt;
+        pthread_t       walk_thrd;
+        int             walking;    /* Files are still being listed */
+
+        int             next;       /* Next file to prepare */
+        int             consumed;   /* Next file to hand to the producer */
+        int             window;     /* Max files prepared ahead */
+        int             term;
+
+        pthread_mutex_t lock;
+        pthread_cond_t  ready_cond; /* Next file is ready */
+        pthread_cond_t  space_cond; /* Window has advanced */
+
+        pthread_t      *thrds;
+        int             thrd_cnt;
+
+        struct fileq_stats stats;
+};
+
+struct fileq *fileq_new (char **paths, int pathcnt, int threads);
+int fileq_next (struct fileq *fq, struct kc_file *f);
+void fileq_release (struct fileq *fq, struct kc_file *f);
+void fileq_destroy (struct fileq *fq, struct fileq_stats *stats);
+
+
+
+/*
+ * chunk.c
+ */
+#define KC_CHUNK_HDR_SIZE  36   /* Fixed chunk header size */
+
+struct chunk_hdr {
+        uint64_t    file_id;
+        uint64_t    file_size;
+        uint32_t    idx;
+        uint32_t    cnt;
+        uint32_t    crc;
+        uint16_t    name_len;
+        const char *name;
+        const char *data;     /* Set by chunk_decode() */
+        size_t      len;
+};
+
+struct reasm_stats {
+        uint64_t files;       /* Files reassembled */
+        uint64_t chunks;
+        uint64_t failed;      /* Files dropped */
+        uint64_t incomplete;  /* Files incomplete on exit */
+        uint64_t skipped;     /* Messages skipped */
+};
+
+extern struct reasm_stats reasm_stats;
+
+uint64_t chunk_file_id (const char *path, uint64_t size);
+size_t chunk_encode (char *buf, struct chunk_hdr *ch,
+                     const char *data, size_t len);
+int chunk_decode (const char *buf, size_t len, struct chunk_hdr *ch);
+
+void reasm_init (const char *dir);
+void reasm_msg (const rd_kafka_message_t *rkmessage);
+void reasm_term (void);
+
+
+
+/*
+ * output.c
+ */
+#define OUTPUT_IOV_MAX  256   /* Pending iovecs before writing */
+
+struct output_stats {
+        uint64_t writes;      /* writev() calls */
+        uint64_t bytes;       /* Bytes written */
+        uint64_t copied;      /* Bytes copied to the output buffer */
+        uint64_t referenced;  /* Bytes written from the messages */
+        uint64_t timed_flushes; /* Flushes due to -U */
+};
+
+struct output {
+        struct output *next;
+        int           fd;
+        int           capture;    /* Only written by output_flush() */
+        int           shared;     /* fd shared with other threads */
+        pthread_t     thrd;       /* Owner thread */
+        struct iovec *iov;
+        int           iovcnt;
+        int           iov_size;
+        size_t        bytes;      /* Pending bytes */
+        int64_t       pending_ts; /* When output became pending */
+        char         *buf;        /* Copy buffer */
+        size_t        buf_of;
+        size_t        buf_size;
+        char        **full_bufs;  /* Filled copy buffers (capture) */
+        int           full_buf_cnt;
+        rd_kafka_message_t **msgs; /* Held messages */
+        int           msg_cnt;
+        int           msg_size;
+        int           msg_ref;    /* Current message is referenced */
+        void        (*flush_cb) (void *opaque); /* Called when written */
+        void         *flush_opaque;
+        struct output_stats stats;
+};
+
+struct output *output_new (int fd);
+struct output *output_new_shared (int fd);
+struct output *output_new_capture (int fd);
+void output_destroy (struct output *out);
+void output_flush (struct output *out);
+void output_flush_all (void);
+void output_write (struct output *out, const void *ptr, size_t len);
+void output_write_ref (struct output *out, const void *ptr, size_t len);
+void output_msg_done (struct output *out, rd_kafka_message_t *rkmessage);
+
+
+
+/*
+ * fmtpipe.c
+ */
+#define KC_FMTPIPE_JOBS  4    /* Jobs in flight per formatter thread */
+#define KC_FMTPIPE_BATCH 1000 /* Default batch size with -j */
+
+struct fmt_job {
+        struct fmt_job      *next;
+        rd_kafka_message_t **msgs;      /* Messages to format */
+        int                  msg_cnt;
+        struct {
+                int32_t partition;
+                int64_t offset;
+        }                   *offsets;   /* Offsets to store once written */
+        int                  offset_cnt;
+        struct output       *out;       /* Formatted output */
+        int                  done;      /* Formatted */
+};
+
+struct fmtpipe_stats {
+        uint64_t jobs;
+        uint64_t submit_waits;   /* Pipeline full (formatter bound) */
+        uint64_t writer_waits;   /* Next job not formatted */
+        struct output_stats out;
+};
+
+struct fmtpipe;
+
+struct fmt_job *fmt_job_new (int size);
+struct fmtpipe *fmtpipe_new (int thread_cnt, int ordered, int fd,
+                             void (*written_cb) (struct fmt_job *job,
+                                                 void *opaque),
+                             void *opaque);
+void fmtpipe_submit (struct fmtpipe *pipe, struct fmt_job *job, int thread);
+void fmtpipe_destroy (struct fmtpipe *pipe, struct fmtpipe_stats *stats);
+
+
+
+/*
+ * jsonscan.c
+ */
+extern const char *(*json_scan_escape) (const char *s, const char *end);
+
+int json_validate (const char *s, const char *end,
+                   const char **startp, const char **endp, int *nlp);
+void json_write_compact (struct output *out, const char *s, const char *end);
+
+struct json_path *json_path_parse (const char *str, size_t len);
+const char *json_path_end (const char *str, char term);
+void json_path_destroy (struct json_path *jp);
+int json_path_get (const struct json_path *jp, const char *s, const char *end,
+                   const char **startp, const char **endp);
+
+void json_scan_init (void);
+
+
+
+/*
+ * filter.c
+ */
+struct filter_stats {
+        uint64_t msgs;           /* Messages filtered */
+        uint64_t bytes;          /* Bytes of filtered fields */
+        uint64_t matched;        /* Messages passing the filter */
+        uint64_t matched_bytes;
+};
+
+void filter_add (const char *pattern, int regex);
+int filter_match (const rd_kafka_message_t *rkmessage,
+                  struct filter_stats *stats);
+void filter_init (void);
+void filter_term (void);
+
+
+
+/*
+ * keyset.c
+ */
+struct keyset_stats {
+        uint64_t lookups;
+        uint64_t bloom_passed;   /* Keys passed by the Bloom filter */
+        uint64_t matched;        /* Keys in the set */
+};
+
+uint64_t kc_hash64 (const void *data, size_t len);
+
+void keyset_load (const char *path);
+int keyset_match (const rd_kafka_message_t *rkmessage,
+                  struct keyset_stats *stats);
+void keyset_term (void);
+
+
+
+/*
+ * summary.c
+ */
+#define KC_SUMMARY_BUCKETS 34  /* Payload sizes 0, 1, 2-3, .., 2^32- */
+
+/**
+ * Partition summary counters.
+ */
+struct summary_part {
+        int32_t  partition;      /* -1 for the total */
+        int      consumed;
+        uint64_t msgs;
+        int64_t  first_offset;
+        int64_t  last_offset;
+        uint64_t key_bytes;
+        uint64_t payload_bytes;
+        uint64_t null_keys;
+        uint64_t null_payloads;
+        uint64_t hist[KC_SUMMARY_BUCKETS];  /* Payload size histogram */
+} __attribute__((aligned(64)));
+
+struct summary {
+        struct summary_part *parts;          /* Indexed by partition */
+        int                  part_cnt;
+        struct summary_part  total;          /* Consumed partitions */
+};
+
+extern struct summary summary;
+
+void summary_init (int part_cnt, const int32_t *partitions, int cnt);
+void summary_bucket_range (int b, uint64_t *minp, uint64_t *maxp);
+void summary_msg (const rd_kafka_message_t *rkmessage);
+void summary_print (FILE *fp);
+void summary_term (void);
+
+
+
+/*
+ * topkeys.c
+ */
+#define KC_TOPK_KEY_MAX  64    /* Key bytes kept for reporting */
+#define KC_TOPK_MAX      10000  /* Max -H keys to report */
+
+struct topk_entry {
+        uint64_t hash;
+        uint64_t count;
+        uint64_t error;          /* Count is at most this overestimated */
+        ssize_t  key_len;        /* Full key length, -1 for NULL keys */
+        int      heap_idx;
+        char     key[KC_TOPK_KEY_MAX];  /* Truncated key */
+};
+
+/**
+ * Reported top keys, of a partition or the topic
+ */
+struct topkeys_list {
+        int32_t  partition;      /* -1 for all partitions */
+        const char *what;        /* "messages" or "bytes" */
+        uint64_t total;
+        struct topk_entry *keys; /* Most frequent first */
+        int      cnt;
+};
+
+void topkeys_init (int n, int interval, FILE *fp,
+                   int part_cnt, const int32_t *partitions, int cnt);
+void topkeys_msg (const rd_kafka_message_t *rkmessage);
+void topkeys_print (void);
+void topkeys_tick (void);
+void topkeys_term (void);
+
+
+
+/*
+ * hll.c
+ */
+#define KC_HLL_PRECISION  14   /* log2 of the registers per sketch */
+#define KC_HLL_REGS       (1 << KC_HLL_PRECISION)
+#define KC_HLL_STDERR     0.0081  /* 1.04 / sqrt(KC_HLL_REGS) */
+
+/**
+ * Partition distinct key sketch.
+ */
+struct hll_part {
+        int32_t  partition;      /* -1 for the total */
+        int      present;        /* Consumed or merged */
+        uint64_t msgs;
+        uint64_t null_keys;
+        uint64_t distinct;       /* Estimate, set by hll_print() */
+        uint8_t *regs;           /* KC_HLL_REGS registers */
+};
+
+struct hll {
+        struct hll_part *parts;          /* Indexed by partition */
+        int              part_cnt;
+        struct hll_part  total;          /* Present partitions */
+};
+
+extern struct hll hll;
+
+void hll_merge_add (const char *path);
+void hll_init (int part_cnt, const int32_t *partitions, int cnt);
+void hll_msg (const rd_kafka_message_t *rkmessage);
+void hll_print (FILE *fp);
+void hll_save (const char *path);
+void hll_term (void);
+
+
+
 #if ENABLE_JSON
 /*
  * json.c
  */
-void fmt_msg_output_json (FILE *fp, const rd_kafka_message_t *rkmessage);
+void fmt_msg_output_json (struct output *out,
+                          const rd_kafka_message_t *rkmessage);
 void metadata_print_json (const struct rd_kafka_metadata *metadata);
+void summary_print_json (FILE *fp);
+void topkeys_print_json (FILE *fp, const struct topkeys_list *lists,
+                         int cnt);
+void hll_print_json (FILE *fp);
 
 void fmt_init_json (void);
 void fmt_term_json (void);
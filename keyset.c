@@ -0,0 +1,441 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "kafkacat.h"
+
+
+/**
+ * Consumer key set (-k).
+ *
+ * Only messages whose key is listed in the key file are output.
+ * The file is memory mapped and its keys, one per line, are loaded by
+ * multiple threads into:
+ *  - a split block Bloom filter of KC_KEYSET_BLOOM_BITS bits per key,
+ *    which rejects most keys that are not in the set with a single
+ *    cache line access, and
+ *  - an open addressing hash table of 8 byte slots, each the key's
+ *    offset in the mapping and a hash tag, which confirms the keys
+ *    the Bloom filter passes.
+ * The keys themselves are not copied: the file stays mapped.
+ */
+
+#define KC_KEYSET_BLOOM_BITS   10       /* Bloom filter bits per key */
+#define KC_KEYSET_THREADS_MAX  16
+#define KC_KEYSET_THREAD_MIN   (1024*1024) /* Min bytes per load thread */
+
+#define KC_KEYSET_TAG_BITS     24
+#define KC_KEYSET_TAG_MASK     ((1u << KC_KEYSET_TAG_BITS) - 1)
+#define KC_KEYSET_OFFSET_MAX   ((UINT64_C(1) << (64 - KC_KEYSET_TAG_BITS)) - 2)
+
+static struct {
+        const char *ptr;       /* Mapped key file */
+        size_t      size;
+
+        uint64_t   *bloom;     /* 512 bit blocks of 8 words */
+        uint64_t    bloom_blocks;
+
+        uint64_t   *slots;     /* (offset + 1) << TAG_BITS | tag, or 0 */
+        uint64_t    slot_cnt;
+
+        uint64_t    key_cnt;   /* Unique keys */
+} keyset;
+
+
+
+static uint64_t load_le64 (const unsigned char *p) {
+        return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+                (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+                (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+                (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+#define ROTL64(v,r)  (((v) << (r)) | ((v) >> (64 - (r))))
+
+static uint64_t fmix64 (uint64_t h) {
+        h ^= h >> 33;
+        h *= UINT64_C(0xff51afd7ed558ccd);
+        h ^= h >> 33;
+        h *= UINT64_C(0xc4ceb9fe1a85ec53);
+        h ^= h >> 33;
+        return h;
+}
+
+/**
+ * Fast non-cryptographic 64-bit hash of 'data' of length 'len'.
+ * The hash is the same on all platforms.
+ */
+uint64_t kc_hash64 (const void *data, size_t len) {
+        const unsigned char *p = data;
+        uint64_t h = UINT64_C(0x9e3779b97f4a7c15) ^
+                ((uint64_t)len * UINT64_C(0xc2b2ae3d27d4eb4f));
+        uint64_t k;
+        size_t i;
+
+        for ( ; len >= 8 ; p += 8, len -= 8) {
+                k = load_le64(p) * UINT64_C(0x87c37b91114253d5);
+                k = ROTL64(k, 31) * UINT64_C(0x4cf5ad432745937f);
+                h ^= k;
+                h = ROTL64(h, 27) * 5 + 0x52dce729;
+        }
+
+        for (k = 0, i = 0 ; i < len ; i++)
+                k |= (uint64_t)p[i] << (i * 8);
+        k *= UINT64_C(0x87c37b91114253d5);
+        h ^= ROTL64(k, 31) * UINT64_C(0x4cf5ad432745937f);
+
+        return fmix64(h);
+}
+
+
+/**
+ * Map hash 'h' to [0..n) without a division.
+ */
+static uint64_t keyset_reduce (uint32_t h, uint64_t n) {
+        return ((uint64_t)h * n) >> 32;
+}
+
+
+/**
+ * Bloom filter: the block is picked by the hash's upper half and
+ * one bit is set in each of the block's eight words by the 6-bit
+ * fields of the remixed hash.
+ */
+static uint64_t *keyset_bloom_block (uint64_t h) {
+        return &keyset.bloom[keyset_reduce(h >> 32,
+                                           keyset.bloom_blocks) * 8];
+}
+
+static void keyset_bloom_add (uint64_t h) {
+        uint64_t *block = keyset_bloom_block(h);
+        uint64_t h2 = h * UINT64_C(0x9e3779b97f4a7c15);
+        int i;
+
+        for (i = 0 ; i < 8 ; i++)
+                __atomic_fetch_or(&block[i],
+                                  UINT64_C(1) << ((h2 >> (i * 6)) & 63),
+                                  __ATOMIC_RELAXED);
+}
+
+static int keyset_bloom_test (uint64_t h) {
+        const uint64_t *block = keyset_bloom_block(h);
+        uint64_t h2 = h * UINT64_C(0x9e3779b97f4a7c15);
+        uint64_t miss = 0;
+        int i;
+
+        for (i = 0 ; i < 8 ; i++)
+                miss |= ~block[i] & (UINT64_C(1) << ((h2 >> (i * 6)) & 63));
+
+        return !miss;
+}
+
+
+/**
+ * Slot tag: the top bits of a remix of the hash, independent of
+ * the bits that select the Bloom block and the slot, so that the
+ * tag also tells apart keys that passed the same Bloom block.
+ */
+static uint32_t keyset_tag (uint64_t h) {
+        return (uint32_t)((h * UINT64_C(0xc2b2ae3d27d4eb4f)) >>
+                          (64 - KC_KEYSET_TAG_BITS));
+}
+
+/**
+ * Returns 1 if the key at offset 'of' in the mapping is 'key'.
+ */
+static int keyset_key_eq (uint64_t of, const char *key, size_t len) {
+        const char *p = keyset.ptr + of;
+        const char *end = keyset.ptr + keyset.size;
+
+        if ((size_t)(end - p) < len || memcmp(p, key, len))
+                return 0;
+
+        /* The key in the file must end here */
+        p += len;
+        return p == end || *p == '\n' ||
+                (*p == '\r' && (p + 1 == end || p[1] == '\n'));
+}
+
+/**
+ * Find key 'key' with hash 'h' in the hash table.
+ * If 'of' is not -1 the key, at offset 'of', is inserted if not found.
+ * Returns 1 if the key was found, else 0.
+ */
+static int keyset_find (uint64_t h, const char *key, size_t len,
+                        int64_t of) {
+        uint32_t tag = keyset_tag(h);
+        uint64_t i = keyset_reduce((uint32_t)h, keyset.slot_cnt);
+        uint64_t v = of == -1 ? 0 :
+                ((uint64_t)(of + 1) << KC_KEYSET_TAG_BITS) | tag;
+
+        while (1) {
+                uint64_t s = __atomic_load_n(&keyset.slots[i],
+                                             __ATOMIC_ACQUIRE);
+
+                if (!s) {
+                        if (of == -1)
+                                return 0;
+                        if (__atomic_compare_exchange_n(
+                                    &keyset.slots[i], &s, v, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                                return 0;
+                        /* Lost the race for the slot: 's' is the
+                         * winner's entry */
+                }
+
+                if ((s & KC_KEYSET_TAG_MASK) == tag &&
+                    keyset_key_eq((s >> KC_KEYSET_TAG_BITS) - 1, key, len))
+                        return 1;
+
+                if (++i == keyset.slot_cnt)
+                        i = 0;
+        }
+}
+
+
+
+/**
+ * Key file load thread, loading the keys in its range of the file.
+ */
+struct keyset_loader {
+        const char *start, *end;  /* Whole lines */
+        uint64_t    line_cnt;
+        uint64_t    key_cnt;      /* Unique keys inserted */
+        int         pass;
+        pthread_t   thrd;
+};
+
+static void *keyset_loader_main (void *arg) {
+        struct keyset_loader *l = arg;
+        const char *s = l->start;
+
+        while (s < l->end) {
+                const char *nl = memchr(s, '\n', l->end - s);
+                const char *kend = nl ? nl : l->end;
+                uint64_t h;
+
+                if (l->pass == 0) {
+                        /* Count lines to size the filter and table */
+                        l->line_cnt++;
+
+                } else {
+                        if (kend > s && kend[-1] == '\r')
+                                kend--;
+
+                        if (kend > s) {
+                                h = kc_hash64(s, kend - s);
+                                keyset_bloom_add(h);
+                                if (!keyset_find(h, s, kend - s,
+                                                 s - keyset.ptr))
+                                        l->key_cnt++;
+                        }
+                }
+
+                if (!nl)
+                        break;
+                s = nl + 1;
+        }
+
+        return NULL;
+}
+
+/**
+ * Run the loader threads' pass 'pass'.
+ */
+static void keyset_load_pass (struct keyset_loader *loaders, int cnt,
+                              int pass) {
+        int i, r;
+
+        for (i = 0 ; i < cnt ; i++) {
+                loaders[i].pass = pass;
+                if ((r = pthread_create(&loaders[i].thrd, NULL,
+                                        keyset_loader_main, &loaders[i])))
+                        FATAL("Failed to create key set load thread: %s",
+                              strerror(r));
+        }
+
+        for (i = 0 ; i < cnt ; i++)
+                pthread_join(loaders[i].thrd, NULL);
+}
+
+
+/**
+ * Load the key set from 'path', one key per line.
+ */
+void keyset_load (const char *path) {
+        struct keyset_loader *loaders;
+        struct timeval tv_start, tv_end;
+        struct stat st;
+        uint64_t line_cnt = 0;
+        const char *s;
+        long ncpu;
+        int fd, cnt, i;
+
+        gettimeofday(&tv_start, NULL);
+
+        if ((fd = open(path, O_RDONLY)) == -1)
+                FATAL("Failed to open key file %s: %s",
+                      path, strerror(errno));
+
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+                FATAL("Key file %s is not a regular file", path);
+
+        if ((uint64_t)st.st_size > KC_KEYSET_OFFSET_MAX)
+                FATAL("Key file %s is too large", path);
+
+        keyset.size = st.st_size;
+        if (keyset.size > 0) {
+                void *ptr = mmap(NULL, keyset.size, PROT_READ, MAP_PRIVATE,
+                                 fd, 0);
+                if (ptr == MAP_FAILED)
+                        FATAL("Failed to mmap key file %s: %s",
+                              path, strerror(errno));
+                keyset.ptr = ptr;
+                madvise(ptr, keyset.size, MADV_WILLNEED);
+        }
+        close(fd);
+
+        /* Split the file into ranges of whole lines, one per thread */
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        cnt = (int)(keyset.size / KC_KEYSET_THREAD_MIN) + 1;
+        if (cnt > ncpu)
+                cnt = ncpu > 0 ? (int)ncpu : 1;
+        if (cnt > KC_KEYSET_THREADS_MAX)
+                cnt = KC_KEYSET_THREADS_MAX;
+
+        loaders = calloc(cnt, sizeof(*loaders));
+        s = keyset.ptr;
+        for (i = 0 ; i < cnt ; i++) {
+                const char *end = keyset.ptr + keyset.size;
+                const char *split = keyset.ptr +
+                        keyset.size / cnt * (i + 1);
+                const char *nl;
+
+                if (i < cnt - 1) {
+                        if (split <= s)
+                                end = s;
+                        else if ((nl = memchr(split - 1, '\n',
+                                              end - split + 1)))
+                                end = nl + 1;
+                }
+
+                loaders[i].start = s;
+                loaders[i].end   = end;
+                s = end;
+        }
+
+        keyset_load_pass(loaders, cnt, 0);
+
+        for (i = 0 ; i < cnt ; i++)
+                line_cnt += loaders[i].line_cnt;
+
+        keyset.bloom_blocks = (line_cnt * KC_KEYSET_BLOOM_BITS + 511) / 512;
+        if (keyset.bloom_blocks == 0)
+                keyset.bloom_blocks = 1;
+        /* Load factor of at most 3/4 */
+        keyset.slot_cnt = line_cnt + line_cnt / 3 + 1;
+
+        if (keyset.slot_cnt > UINT32_MAX)
+                FATAL("Key file %s has too many keys", path);
+
+        if (posix_memalign((void **)&keyset.bloom, 64,
+                           keyset.bloom_blocks * 64))
+                FATAL("Failed to allocate key set Bloom filter");
+        memset(keyset.bloom, 0, keyset.bloom_blocks * 64);
+
+        if (!(keyset.slots = calloc(keyset.slot_cnt,
+                                    sizeof(*keyset.slots))))
+                FATAL("Failed to allocate key set of %"PRIu64" slots",
+                      keyset.slot_cnt);
+
+        keyset_load_pass(loaders, cnt, 1);
+
+        for (i = 0 ; i < cnt ; i++)
+                keyset.key_cnt += loaders[i].key_cnt;
+
+        free(loaders);
+
+        /* Keys are confirmed at random */
+        if (keyset.size > 0)
+                madvise((void *)keyset.ptr, keyset.size, MADV_RANDOM);
+
+        gettimeofday(&tv_end, NULL);
+
+        INFO(1, "Loaded %"PRIu64" keys from %s in %.3fs "
+             "(%i threads, %"PRIu64" bytes of Bloom filter and "
+             "%"PRIu64" bytes of hash table)\n",
+             keyset.key_cnt, path,
+             (double)(tv_end.tv_sec - tv_start.tv_sec) +
+             (double)(tv_end.tv_usec - tv_start.tv_usec) / 1000000.0,
+             cnt, keyset.bloom_blocks * 64,
+             keyset.slot_cnt * (uint64_t)sizeof(*keyset.slots));
+}
+
+
+/**
+ * Returns 1 if the key of 'rkmessage' is in the key set, or if there
+ * is no key set, else 0. The lookup is counted in 'stats'.
+ */
+int keyset_match (const rd_kafka_message_t *rkmessage,
+                  struct keyset_stats *stats) {
+        uint64_t h;
+
+        if (!keyset.slots)
+                return 1;
+
+        stats->lookups++;
+
+        if (!rkmessage->key || rkmessage->key_len == 0)
+                return 0;
+
+        h = kc_hash64(rkmessage->key, rkmessage->key_len);
+        if (!keyset_bloom_test(h))
+                return 0;
+
+        stats->bloom_passed++;
+
+        if (!keyset_find(h, rkmessage->key, rkmessage->key_len, -1))
+                return 0;
+
+        stats->matched++;
+        return 1;
+}
+
+
+void keyset_term (void) {
+        if (keyset.size > 0)
+                munmap((void *)keyset.ptr, keyset.size);
+        free(keyset.bloom);
+        free(keyset.slots);
+        memset(&keyset, 0, sizeof(keyset));
+}
@@ -0,0 +1,416 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "kafkacat.h"
+
+
+/**
+ * Consumer output.
+ *
+ * Formatted output is gathered in an iovec array and written with
+ * writev().
+ * Small fragments (delimiters, numbers, short keys and payloads) are
+ * copied to the output's buffer, larger keys and payloads are
+ * referenced in place: the messages they belong to are held by the
+ * output and destroyed once they have been written.
+ *
+ * Output is written when it has piled up, when the consumer is idle,
+ * and at most conf.flush_ms (-U) after it was formatted, so that
+ * messages show up promptly on a busy but slow stream.
+ *
+ * A capture output instead grows to hold everything formatted to it
+ * and is only written by output_flush(), this is used to format
+ * messages on one thread and write them on another (-j).
+ *
+ * A shared output writes to an fd that other threads' outputs also
+ * write to (-N): it grows rather than writing in the middle of a
+ * message, and its writes are serialized, so that messages from
+ * different threads are never interleaved.
+ */
+
+#define OUTPUT_BUF_SIZE     (64*1024)  /* Copy buffer */
+#define OUTPUT_REF_MIN      512        /* Smaller fragments are copied */
+#define OUTPUT_FLUSH_BYTES  (1024*1024) /* Flush at this many bytes */
+
+#ifdef IOV_MAX
+#define OUTPUT_WRITEV_MAX   IOV_MAX
+#else
+#define OUTPUT_WRITEV_MAX   1024
+#endif
+
+static struct output *outputs;   /* All outputs, for output_flush_all() */
+static pthread_mutex_t outputs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serializes writes of shared outputs */
+static pthread_mutex_t output_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int64_t output_clock_ms (void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Output is about to become pending: note the time.
+ */
+static void output_pending (struct output *out) {
+        if (out->bytes == 0 && conf.flush_ms > 0 && !out->capture)
+                out->pending_ts = output_clock_ms();
+}
+
+
+/**
+ * Returns true if the output grows rather than writing before it
+ * is flushed or the current message is done.
+ */
+static int output_grows (const struct output *out) {
+        return out->capture || out->shared;
+}
+
+
+static struct output *output_alloc (int fd, int capture, int shared) {
+        struct output *out;
+
+        out = calloc(1, sizeof(*out));
+        out->fd       = fd;
+        out->capture  = capture;
+        out->shared   = shared;
+        out->buf_size = OUTPUT_BUF_SIZE;
+        out->buf      = malloc(out->buf_size);
+        out->iov_size = OUTPUT_IOV_MAX;
+        out->iov      = malloc(sizeof(*out->iov) * out->iov_size);
+        out->msg_size = OUTPUT_IOV_MAX;
+        out->msgs     = malloc(sizeof(*out->msgs) * out->msg_size);
+
+        return out;
+}
+
+static struct output *output_register (struct output *out) {
+        out->thrd = pthread_self();
+
+        pthread_mutex_lock(&outputs_lock);
+        out->next = outputs;
+        outputs = out;
+        pthread_mutex_unlock(&outputs_lock);
+
+        return out;
+}
+
+/**
+ * Create output writing to 'fd'.
+ */
+struct output *output_new (int fd) {
+        return output_register(output_alloc(fd, 0, 0));
+}
+
+/**
+ * Create shared output writing to 'fd', which outputs on other threads
+ * also write to.
+ */
+struct output *output_new_shared (int fd) {
+        return output_register(output_alloc(fd, 0, 1));
+}
+
+/**
+ * Create capture output, written to 'fd' by output_flush().
+ * Capture outputs are not flushed by output_flush_all().
+ */
+struct output *output_new_capture (int fd) {
+        return output_alloc(fd, 1, 0);
+}
+
+
+/**
+ * Flush and destroy output.
+ */
+void output_destroy (struct output *out) {
+        output_flush(out);
+
+        if (!out->capture) {
+                struct output **prevp;
+
+                pthread_mutex_lock(&outputs_lock);
+                for (prevp = &outputs ; *prevp != out ;
+                     prevp = &(*prevp)->next)
+                        ;
+                *prevp = out->next;
+                pthread_mutex_unlock(&outputs_lock);
+        }
+
+        free(out->full_bufs);
+        free(out->buf);
+        free(out->iov);
+        free(out->msgs);
+        free(out);
+}
+
+
+/**
+ * Write all of 'iovcnt' 'iov's to the output's fd.
+ * 'iov' is modified.
+ */
+static void output_writev (struct output *out, struct iovec *iov,
+                           int iovcnt) {
+
+        while (iovcnt > 0) {
+                ssize_t r;
+
+                r = writev(out->fd, iov, iovcnt < OUTPUT_WRITEV_MAX ?
+                           iovcnt : OUTPUT_WRITEV_MAX);
+                if (r == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN) {
+                                struct pollfd pfd = { out->fd, POLLOUT };
+                                poll(&pfd, 1, -1);
+                                continue;
+                        }
+                        /* Nothing more is written on exit, and
+                         * nothing is flushed. */
+                        out->iovcnt = 0;
+                        out->flush_cb = NULL;
+                        if (out->shared)
+                                pthread_mutex_unlock(&output_shared_lock);
+                        FATAL("Output write error: %s", strerror(errno));
+                }
+
+                out->stats.writes++;
+                out->stats.bytes += r;
+
+                /* Skip fully written iovecs, adjust partially written one */
+                while (iovcnt > 0 && (size_t)r >= iov->iov_len) {
+                        r -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+
+                if (iovcnt > 0) {
+                        iov->iov_base = (char *)iov->iov_base + r;
+                        iov->iov_len -= r;
+                }
+        }
+}
+
+
+/**
+ * Write all pending output, destroy the held messages, and call
+ * the flush callback.
+ */
+void output_flush (struct output *out) {
+        int i;
+
+        if (out->iovcnt > 0) {
+                if (out->shared)
+                        pthread_mutex_lock(&output_shared_lock);
+                output_writev(out, out->iov, out->iovcnt);
+                if (out->shared)
+                        pthread_mutex_unlock(&output_shared_lock);
+        }
+
+        for (i = 0 ; i < out->msg_cnt ; i++)
+                rd_kafka_message_destroy(out->msgs[i]);
+
+        for (i = 0 ; i < out->full_buf_cnt ; i++)
+                free(out->full_bufs[i]);
+
+        out->iovcnt  = 0;
+        out->bytes   = 0;
+        out->buf_of  = 0;
+        out->msg_cnt = 0;
+        out->full_buf_cnt = 0;
+
+        if (out->flush_cb)
+                out->flush_cb(out->flush_opaque);
+}
+
+
+/**
+ * Flush all outputs of the calling thread, used on fatal errors.
+ * Other threads' outputs are in use and can't be flushed.
+ */
+void output_flush_all (void) {
+        static __thread int flushing;
+        struct output *out;
+
+        /* A write error while flushing ends up here again */
+        if (flushing++)
+                return;
+
+        pthread_mutex_lock(&outputs_lock);
+        for (out = outputs ; out ; out = out->next)
+                if (pthread_equal(out->thrd, pthread_self()))
+                        output_flush(out);
+        pthread_mutex_unlock(&outputs_lock);
+}
+
+
+/**
+ * Returns a new iovec at the end of the output's iovec array,
+ * flushing or growing the array if full.
+ */
+static struct iovec *output_iov_new (struct output *out) {
+        if (out->iovcnt == out->iov_size) {
+                if (output_grows(out)) {
+                        out->iov_size *= 2;
+                        out->iov = realloc(out->iov, sizeof(*out->iov) *
+                                           out->iov_size);
+                } else
+                        output_flush(out);
+        }
+
+        return &out->iov[out->iovcnt++];
+}
+
+
+/**
+ * Start a new copy buffer of at least 'len' bytes for a growing
+ * output, keeping the current buffer until the output is flushed.
+ */
+static void output_buf_new (struct output *out, size_t len) {
+        if ((out->full_buf_cnt & 15) == 0)
+                out->full_bufs = realloc(out->full_bufs,
+                                         sizeof(*out->full_bufs) *
+                                         (out->full_buf_cnt + 16));
+        out->full_bufs[out->full_buf_cnt++] = out->buf;
+
+        out->buf_size = len > OUTPUT_BUF_SIZE ? len : OUTPUT_BUF_SIZE;
+        out->buf      = malloc(out->buf_size);
+        out->buf_of   = 0;
+}
+
+
+/**
+ * Write a copy of 'len' bytes at 'ptr'.
+ */
+void output_write (struct output *out, const void *ptr, size_t len) {
+        struct iovec *iov;
+
+        if (len == 0)
+                return;
+
+        if (len > out->buf_size - out->buf_of) {
+                if (output_grows(out))
+                        output_buf_new(out, len);
+                else {
+                        output_flush(out);
+
+                        if (len > out->buf_size) {
+                                struct iovec one = { (void *)ptr, len };
+                                output_writev(out, &one, 1);
+                                return;
+                        }
+                }
+        } else if (out->iovcnt == out->iov_size && !output_grows(out))
+                output_flush(out); /* Before the copy: resets the buffer */
+
+        output_pending(out);
+        memcpy(out->buf + out->buf_of, ptr, len);
+        out->stats.copied += len;
+
+        /* Extend the previous iovec if it ends where this copy starts */
+        iov = out->iovcnt > 0 ? &out->iov[out->iovcnt-1] : NULL;
+        if (iov && (char *)iov->iov_base + iov->iov_len ==
+            out->buf + out->buf_of) {
+                iov->iov_len += len;
+        } else {
+                iov = output_iov_new(out);
+                iov->iov_base = out->buf + out->buf_of;
+                iov->iov_len  = len;
+        }
+
+        out->buf_of += len;
+        out->bytes  += len;
+}
+
+
+/**
+ * Write 'len' bytes at 'ptr' which belong to the message currently
+ * being output: the data is referenced until it is written, and the
+ * message must be passed to output_msg_done() when it has been output.
+ */
+void output_write_ref (struct output *out, const void *ptr, size_t len) {
+        struct iovec *iov;
+
+        if (len < OUTPUT_REF_MIN) {
+                output_write(out, ptr, len);
+                return;
+        }
+
+        iov = output_iov_new(out);
+        output_pending(out);
+        iov->iov_base = (void *)ptr;
+        iov->iov_len  = len;
+        out->bytes += len;
+        out->msg_ref = 1;
+        out->stats.referenced += len;
+}
+
+
+/**
+ * Message 'rkmessage' has been output: destroy it, or hold it until
+ * its referenced data has been written.
+ * The output is flushed when enough output is pending, when the
+ * pending output is older than conf.flush_ms, or after every message
+ * in unbuffered mode (-u).
+ */
+void output_msg_done (struct output *out, rd_kafka_message_t *rkmessage) {
+        if (out->msg_ref) {
+                if (out->msg_cnt == out->msg_size) {
+                        if (output_grows(out)) {
+                                out->msg_size *= 2;
+                                out->msgs = realloc(out->msgs,
+                                                    sizeof(*out->msgs) *
+                                                    out->msg_size);
+                        } else
+                                output_flush(out);
+                }
+                out->msgs[out->msg_cnt++] = rkmessage;
+                out->msg_ref = 0;
+        } else
+                rd_kafka_message_destroy(rkmessage);
+
+        if (out->capture)
+                return;
+
+        if (out->bytes >= OUTPUT_FLUSH_BYTES ||
+            (conf.flags & CONF_F_UNBUF))
+                output_flush(out);
+        else if (out->bytes > 0 && conf.flush_ms > 0 &&
+                 output_clock_ms() - out->pending_ts >= conf.flush_ms) {
+                out->stats.timed_flushes++;
+                output_flush(out);
+        }
+}
@@ -0,0 +1,169 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+
+#include "kafkacat.h"
+
+
+/**
+ * Producer message buffer pool.
+ *
+ * Buffers are kept in power-of-two size classes from 64 bytes to 1 MiB,
+ * larger buffers are allocated and freed on demand.
+ * Each class keeps at most POOL_CLASS_MAX_FREE bytes of free buffers.
+ * The pool is only locked when buffers are taken and returned by
+ * different threads, see pool_init().
+ */
+
+#define POOL_MIN_SHIFT       6   /* 64 bytes */
+#define POOL_CLASS_CNT       15  /* 64 bytes .. 1 MiB */
+#define POOL_CLASS_MAX_FREE  (16*1024*1024)
+
+static struct {
+        struct pool_buf *free[POOL_CLASS_CNT];
+        size_t           free_bytes[POOL_CLASS_CNT];
+        int              threaded;
+        pthread_mutex_t  lock;
+} pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define POOL_LOCK() do {                                \
+                if (pool.threaded)                      \
+                        pthread_mutex_lock(&pool.lock); \
+        } while (0)
+
+#define POOL_UNLOCK() do {                                      \
+                if (pool.threaded)                              \
+                        pthread_mutex_unlock(&pool.lock);       \
+        } while (0)
+
+struct pool_stats pool_stats;
+
+
+/**
+ * Enable pool locking if 'threaded' is set.
+ * Must be called before the pool is used by more than one thread.
+ */
+void pool_init (int threaded) {
+        pool.threaded = threaded;
+}
+
+
+/**
+ * Returns the size class for 'size' bytes, which is >= POOL_CLASS_CNT
+ * for sizes not handled by the pool.
+ */
+static int pool_class (size_t size) {
+        if (size <= (1 << POOL_MIN_SHIFT))
+                return 0;
+        return (int)(sizeof(long) * 8) - __builtin_clzl(size - 1) -
+                POOL_MIN_SHIFT;
+}
+
+
+/**
+ * Get a buffer of at least 'size' bytes from the pool.
+ */
+struct pool_buf *pool_get (size_t size) {
+        struct pool_buf *pb;
+        int cls = pool_class(size);
+        size_t bsize;
+
+        POOL_LOCK();
+        if (cls < POOL_CLASS_CNT && (pb = pool.free[cls])) {
+                pool.free[cls] = pb->next;
+                pool.free_bytes[cls] -= pb->size;
+                pool_stats.hits++;
+                POOL_UNLOCK();
+                return pb;
+        }
+
+        pool_stats.misses++;
+        POOL_UNLOCK();
+
+        if (cls < POOL_CLASS_CNT)
+                bsize = (size_t)1 << (cls + POOL_MIN_SHIFT);
+        else {
+                bsize = size;
+                cls   = -1;
+        }
+
+        if (!(pb = malloc(sizeof(*pb) + bsize)))
+                FATAL("Failed to allocate %zd bytes message buffer", bsize);
+
+        pb->owner = KC_MSG_OWNER_POOL;
+        pb->cls   = cls;
+        pb->size  = bsize;
+
+        POOL_LOCK();
+        pool_stats.bytes_resident += bsize;
+        POOL_UNLOCK();
+
+        return pb;
+}
+
+
+/**
+ * Return buffer to the pool.
+ */
+void pool_put (struct pool_buf *pb) {
+        POOL_LOCK();
+        if (pb->cls == -1 ||
+            pool.free_bytes[pb->cls] + pb->size > POOL_CLASS_MAX_FREE) {
+                pool_stats.bytes_resident -= pb->size;
+                POOL_UNLOCK();
+                free(pb);
+                return;
+        }
+
+        pb->next = pool.free[pb->cls];
+        pool.free[pb->cls] = pb;
+        pool.free_bytes[pb->cls] += pb->size;
+        POOL_UNLOCK();
+}
+
+
+/**
+ * Free all pooled buffers.
+ */
+void pool_term (void) {
+        int i;
+
+        for (i = 0 ; i < POOL_CLASS_CNT ; i++) {
+                struct pool_buf *pb;
+
+                while ((pb = pool.free[i])) {
+                        pool.free[i] = pb->next;
+                        pool_stats.bytes_resident -= pb->size;
+                        free(pb);
+                }
+                pool.free_bytes[i] = 0;
+        }
+}
@@ -0,0 +1,205 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "kafkacat.h"
+
+
+/**
+ * Single-producer/single-consumer message ring.
+ *
+ * The ring itself is lock-free: the push side owns 'head' and the
+ * pop side owns 'tail'.
+ * A side that finds the ring full (push) or empty (pop) flags itself
+ * as waiting and sleeps on its wakeup pipe through the caller's wait
+ * callback, the other side writes to that pipe when it makes progress.
+ */
+
+#define RING_WAITING 1
+
+
+static void ring_pipe (int *fds) {
+        if (pipe(fds) == -1)
+                FATAL("Failed to create pipe: %s", strerror(errno));
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+}
+
+static void ring_wakeup (int fd) {
+        if (write(fd, "1", 1) == -1) {
+                /* Pipe full: wakeup already pending */
+        }
+}
+
+static void ring_drain (int fd) {
+        char tmp[64];
+        while (read(fd, tmp, sizeof(tmp)) > 0)
+                ;
+}
+
+
+/**
+ * Create a ring of at least 'depth' messages.
+ */
+struct ring *ring_new (int depth) {
+        struct ring *ring;
+        size_t size = 2;
+
+        while (size < (size_t)depth)
+                size <<= 1;
+
+        ring = calloc(1, sizeof(*ring));
+        ring->slots = malloc(sizeof(*ring->slots) * size);
+        ring->mask  = size - 1;
+
+        ring_pipe(ring->pop_fds);
+        ring_pipe(ring->push_fds);
+
+        return ring;
+}
+
+
+void ring_destroy (struct ring *ring) {
+        close(ring->pop_fds[0]);
+        close(ring->pop_fds[1]);
+        close(ring->push_fds[0]);
+        close(ring->push_fds[1]);
+        free(ring->slots);
+        free(ring);
+}
+
+
+/**
+ * Push message to the ring, waiting for space if the ring is full.
+ * 'wait_cb' is called with 'opaque' to wait for 'fd' to become readable
+ * and should return 0 to abort the wait.
+ *
+ * Returns 1 if the message was pushed, or 0 if the wait was aborted.
+ */
+int ring_push (struct ring *ring, const struct prod_msg *pm,
+               int (*wait_cb) (int fd, void *opaque),
+               void *opaque) {
+        size_t head = ring->head;
+
+        while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >
+               ring->mask) {
+                int ok = 1;
+
+                ring->stats.push_waits++;
+
+                __atomic_store_n(&ring->push_waiting, RING_WAITING,
+                                 __ATOMIC_SEQ_CST);
+                if (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) >
+                    ring->mask) {
+                        ok = wait_cb(ring->push_fds[0], opaque);
+                        ring_drain(ring->push_fds[0]);
+                }
+                __atomic_store_n(&ring->push_waiting, 0, __ATOMIC_SEQ_CST);
+
+                if (!ok)
+                        return 0;
+        }
+
+        ring->slots[head & ring->mask] = *pm;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_exchange_n(&ring->pop_waiting, 0, __ATOMIC_SEQ_CST))
+                ring_wakeup(ring->pop_fds[1]);
+
+        return 1;
+}
+
+
+/**
+ * Pop message from the ring, waiting for a message if the ring is empty.
+ * 'wait_cb' is as for ring_push().
+ *
+ * Returns 1 if a message was popped, or 0 if the ring has been closed
+ * and is empty, or the wait was aborted.
+ */
+int ring_pop (struct ring *ring, struct prod_msg *pm,
+              int (*wait_cb) (int fd, void *opaque),
+              void *opaque) {
+        size_t tail = ring->tail;
+        size_t head;
+
+        while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) ==
+               tail) {
+                int ok = 1;
+
+                /* Pushes are visible before the ring is closed. */
+                if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+                        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+                            tail)
+                                return 0;
+                        continue;
+                }
+
+                ring->stats.pop_waits++;
+
+                __atomic_store_n(&ring->pop_waiting, RING_WAITING,
+                                 __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail &&
+                    !__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) {
+                        ok = wait_cb(ring->pop_fds[0], opaque);
+                        ring_drain(ring->pop_fds[0]);
+                }
+                __atomic_store_n(&ring->pop_waiting, 0, __ATOMIC_SEQ_CST);
+
+                if (!ok)
+                        return 0;
+        }
+
+        /* Occupancy as seen by the pop side */
+        ring->stats.pops++;
+        ring->stats.occupancy_sum += head - tail;
+        if (head - tail > ring->stats.occupancy_max)
+                ring->stats.occupancy_max = head - tail;
+
+        *pm = ring->slots[tail & ring->mask];
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_exchange_n(&ring->push_waiting, 0, __ATOMIC_SEQ_CST))
+                ring_wakeup(ring->push_fds[1]);
+
+        return 1;
+}
+
+
+/**
+ * Close the push side of the ring: ring_pop() returns 0 once
+ * all pushed messages have been popped.
+ */
+void ring_close (struct ring *ring) {
+        __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_exchange_n(&ring->pop_waiting, 0, __ATOMIC_SEQ_CST))
+                ring_wakeup(ring->pop_fds[1]);
+}
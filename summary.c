@@ -0,0 +1,240 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "kafkacat.h"
+
+
+/**
+ * Consumer summary mode (-s).
+ *
+ * Instead of formatting the consumed messages they are only counted,
+ * per partition, and the counts are printed when the consumer exits.
+ * Each partition is consumed by a single instance, so the partitions'
+ * counters need no locking.
+ */
+
+struct summary summary;
+
+
+/**
+ * Set up summary counters for the topic's 'part_cnt' partitions, of
+ * which the 'cnt' partitions in 'partitions' are consumed.
+ */
+void summary_init (int part_cnt, const int32_t *partitions, int cnt) {
+        int i;
+
+        if (posix_memalign((void **)&summary.parts, 64,
+                           sizeof(*summary.parts) * part_cnt))
+                FATAL("Failed to allocate summary of %i partitions",
+                      part_cnt);
+        memset(summary.parts, 0, sizeof(*summary.parts) * part_cnt);
+        summary.part_cnt = part_cnt;
+
+        for (i = 0 ; i < part_cnt ; i++) {
+                summary.parts[i].partition = i;
+                summary.parts[i].first_offset = -1;
+                summary.parts[i].last_offset = -1;
+        }
+
+        for (i = 0 ; i < cnt ; i++)
+                summary.parts[partitions[i]].consumed = 1;
+}
+
+
+/**
+ * Returns the payload size histogram bucket for 'len':
+ * 0 for empty payloads, else b for sizes 2^(b-1) .. 2^b-1.
+ */
+static int summary_bucket (size_t len) {
+        int b;
+
+        if (len == 0)
+                return 0;
+
+        b = 64 - __builtin_clzll((unsigned long long)len);
+        return b < KC_SUMMARY_BUCKETS ? b : KC_SUMMARY_BUCKETS - 1;
+}
+
+/**
+ * Sizes in histogram bucket 'b', the last bucket has no upper bound.
+ */
+void summary_bucket_range (int b, uint64_t *minp, uint64_t *maxp) {
+        *minp = b == 0 ? 0 : UINT64_C(1) << (b - 1);
+        *maxp = b == 0 ? 0 :
+                b == KC_SUMMARY_BUCKETS - 1 ? UINT64_MAX :
+                (UINT64_C(1) << b) - 1;
+}
+
+
+/**
+ * Count consumed message 'rkmessage'.
+ */
+void summary_msg (const rd_kafka_message_t *rkmessage) {
+        struct summary_part *sp = &summary.parts[rkmessage->partition];
+
+        if (sp->msgs++ == 0)
+                sp->first_offset = rkmessage->offset;
+        sp->last_offset = rkmessage->offset;
+
+        if (rkmessage->key)
+                sp->key_bytes += rkmessage->key_len;
+        else
+                sp->null_keys++;
+
+        if (rkmessage->payload)
+                sp->payload_bytes += rkmessage->len;
+        else
+                sp->null_payloads++;
+
+        sp->hist[summary_bucket(rkmessage->len)]++;
+}
+
+
+/**
+ * Sum the consumed partitions' counters into summary.total.
+ */
+static void summary_sum (void) {
+        struct summary_part *t = &summary.total;
+        int i, b;
+
+        memset(t, 0, sizeof(*t));
+        t->partition = -1;
+        t->first_offset = -1;
+        t->last_offset = -1;
+
+        for (i = 0 ; i < summary.part_cnt ; i++) {
+                const struct summary_part *sp = &summary.parts[i];
+
+                if (!sp->consumed)
+                        continue;
+
+                t->msgs          += sp->msgs;
+                t->key_bytes     += sp->key_bytes;
+                t->payload_bytes += sp->payload_bytes;
+                t->null_keys     += sp->null_keys;
+                t->null_payloads += sp->null_payloads;
+                for (b = 0 ; b < KC_SUMMARY_BUCKETS ; b++)
+                        t->hist[b] += sp->hist[b];
+        }
+}
+
+
+static void summary_print_row (FILE *fp, const char *name,
+                               const struct summary_part *sp) {
+        char first[24] = "-", last[24] = "-";
+
+        /* Offsets are per partition */
+        if (sp->msgs > 0 && sp->partition != -1) {
+                snprintf(first, sizeof(first), "%"PRId64, sp->first_offset);
+                snprintf(last, sizeof(last), "%"PRId64, sp->last_offset);
+        }
+
+        fprintf(fp, "%-10s %12"PRIu64" %14s %14s %14"PRIu64" %14"PRIu64
+                " %10"PRIu64" %10"PRIu64"\n",
+                name, sp->msgs, first, last,
+                sp->key_bytes, sp->payload_bytes,
+                sp->null_keys, sp->null_payloads);
+}
+
+/**
+ * Print the summary table to 'fp'.
+ */
+static void summary_print_table (FILE *fp) {
+        const struct summary_part *t = &summary.total;
+        int i, b, bmin = -1, bmax = -1;
+
+        fprintf(fp, "%-10s %12s %14s %14s %14s %14s %10s %10s\n",
+                "Partition", "Messages", "First offset", "Last offset",
+                "Key bytes", "Payload bytes", "NULL keys", "NULL msgs");
+
+        for (i = 0 ; i < summary.part_cnt ; i++) {
+                char name[16];
+
+                if (!summary.parts[i].consumed)
+                        continue;
+
+                snprintf(name, sizeof(name), "%i", i);
+                summary_print_row(fp, name, &summary.parts[i]);
+        }
+
+        summary_print_row(fp, "Total", t);
+
+        for (b = 0 ; b < KC_SUMMARY_BUCKETS ; b++) {
+                if (!t->hist[b])
+                        continue;
+                if (bmin == -1)
+                        bmin = b;
+                bmax = b;
+        }
+
+        if (bmin == -1)
+                return;
+
+        fprintf(fp, "\n%-25s %12s %8s\n",
+                "Payload size", "Messages", "Percent");
+        for (b = bmin ; b <= bmax ; b++) {
+                uint64_t min, max;
+                char range[48];
+
+                summary_bucket_range(b, &min, &max);
+                if (b == 0)
+                        snprintf(range, sizeof(range), "0");
+                else if (max == UINT64_MAX)
+                        snprintf(range, sizeof(range), "%"PRIu64" -", min);
+                else
+                        snprintf(range, sizeof(range),
+                                 "%"PRIu64" - %"PRIu64, min, max);
+
+                fprintf(fp, "%-25s %12"PRIu64" %7.2f%%\n",
+                        range, t->hist[b],
+                        100.0 * t->hist[b] / t->msgs);
+        }
+}
+
+
+/**
+ * Print the summary to 'fp', as JSON with -J.
+ */
+void summary_print (FILE *fp) {
+        summary_sum();
+
+#if ENABLE_JSON
+        if (conf.flags & CONF_F_FMT_JSON)
+                summary_print_json(fp);
+        else
+#endif
+                summary_print_table(fp);
+
+        fflush(fp);
+}
+
+
+void summary_term (void) {
+        free(summary.parts);
+        memset(&summary, 0, sizeof(summary));
+}
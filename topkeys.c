@@ -0,0 +1,500 @@
+/*
+ * kafkacat - Apache Kafka consumer and producer
+ *
+ * Copyright (c) 2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+#include <time.h>
+
+#include "kafkacat.h"
+
+
+/**
+ * Consumer heavy hitter keys (-H).
+ *
+ * The most frequent keys, by messages and by bytes, are tracked per
+ * partition with the space-saving algorithm: a fixed number of
+ * counters, KC_TOPK_CAP_FACTOR per reported key, each counting
+ * a key. A key without a counter takes over the smallest counter,
+ * inheriting its count as its possible overestimation (error).
+ * Any key occuring more than total/counters times is guaranteed to
+ * have a counter, so memory use is fixed regardless of topic size.
+ *
+ * The counters are kept in a min-heap, to find the smallest counter,
+ * indexed by a hash table on the key's hash.
+ * The topic's top keys are found by merging the partitions' counters.
+ */
+
+#define KC_TOPK_CAP_FACTOR  16      /* Counters per reported key */
+#define KC_TOPK_CAP_MIN     64
+
+struct topk {
+        struct topk_entry *entries;
+        int                cnt;
+        int                size;
+        int               *heap;      /* Entry indices, min-heap on count */
+        int               *table;     /* Entry index + 1, or 0 */
+        uint32_t           mask;
+        uint64_t           total;     /* Sum of all weights added */
+};
+
+struct topkeys_part {
+        pthread_mutex_t lock;         /* Only with periodic reports */
+        int             consumed;
+        struct topk     msgs;
+        struct topk     bytes;
+};
+
+static struct {
+        struct topkeys_part *parts;   /* Indexed by partition */
+        int                  part_cnt;
+        int                  n;       /* Keys to report */
+        int                  interval;
+        time_t               next_report;
+        FILE                *fp;
+} topkeys;
+
+
+static void topk_init (struct topk *tk, int size) {
+        uint32_t tsize = 1;
+
+        while (tsize < (uint32_t)size * 2)
+                tsize <<= 1;
+
+        tk->entries = calloc(size, sizeof(*tk->entries));
+        tk->heap    = malloc(sizeof(*tk->heap) * size);
+        tk->table   = calloc(tsize, sizeof(*tk->table));
+        tk->mask    = tsize - 1;
+        tk->size    = size;
+        tk->cnt     = 0;
+        tk->total   = 0;
+}
+
+static void topk_destroy (struct topk *tk) {
+        free(tk->entries);
+        free(tk->heap);
+        free(tk->table);
+}
+
+
+static void topk_heap_swap (struct topk *tk, int a, int b) {
+        int t = tk->heap[a];
+
+        tk->heap[a] = tk->heap[b];
+        tk->heap[b] = t;
+        tk->entries[tk->heap[a]].heap_idx = a;
+        tk->entries[tk->heap[b]].heap_idx = b;
+}
+
+#define TOPK_HEAP_COUNT(tk,i)  ((tk)->entries[(tk)->heap[i]].count)
+
+static void topk_sift_up (struct topk *tk, int i) {
+        while (i > 0 &&
+               TOPK_HEAP_COUNT(tk, (i - 1) / 2) > TOPK_HEAP_COUNT(tk, i)) {
+                topk_heap_swap(tk, i, (i - 1) / 2);
+                i = (i - 1) / 2;
+        }
+}
+
+static void topk_sift_down (struct topk *tk, int i) {
+        while (1) {
+                int l = i * 2 + 1, r = l + 1, min = i;
+
+                if (l < tk->cnt &&
+                    TOPK_HEAP_COUNT(tk, l) < TOPK_HEAP_COUNT(tk, min))
+                        min = l;
+                if (r < tk->cnt &&
+                    TOPK_HEAP_COUNT(tk, r) < TOPK_HEAP_COUNT(tk, min))
+                        min = r;
+                if (min == i)
+                        break;
+
+                topk_heap_swap(tk, i, min);
+                i = min;
+        }
+}
+
+
+/**
+ * Returns the table slot of the key, or of the empty slot where
+ * it should be inserted.
+ * Keys are told apart by hash, length and their first KC_TOPK_KEY_MAX
+ * bytes, so that keys with colliding hashes are counted separately.
+ */
+static uint32_t topk_table_find (const struct topk *tk, uint64_t hash,
+                                 const char *key, ssize_t key_len) {
+        uint32_t i = (uint32_t)hash & tk->mask;
+        size_t len = key_len < KC_TOPK_KEY_MAX ?
+                (key_len > 0 ? (size_t)key_len : 0) : KC_TOPK_KEY_MAX;
+
+        while (tk->table[i]) {
+                const struct topk_entry *e = &tk->entries[tk->table[i] - 1];
+
+                if (e->hash == hash && e->key_len == key_len &&
+                    (len == 0 || !memcmp(e->key, key, len)))
+                        break;
+
+                i = (i + 1) & tk->mask;
+        }
+
+        return i;
+}
+
+/**
+ * Delete table slot 'i', moving back the following entries of
+ * the probe sequence.
+ */
+static void topk_table_del (struct topk *tk, uint32_t i) {
+        uint32_t j = i;
+
+        while (1) {
+                uint32_t k;
+
+                j = (j + 1) & tk->mask;
+                if (!tk->table[j])
+                        break;
+
+                /* Entry's home slot */
+                k = (uint32_t)tk->entries[tk->table[j] - 1].hash & tk->mask;
+
+                /* Move the entry back unless its home slot is
+                 * cyclically in (i, j] */
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                        continue;
+
+                tk->table[i] = tk->table[j];
+                i = j;
+        }
+
+        tk->table[i] = 0;
+}
+
+
+/**
+ * Add 'weight' to key 'key' of length 'key_len' (-1 for NULL keys)
+ * with hash 'hash', whose count may be overestimated by 'error'.
+ */
+static void topk_add (struct topk *tk, uint64_t hash,
+                      const char *key, ssize_t key_len,
+                      uint64_t weight, uint64_t error) {
+        uint32_t slot = topk_table_find(tk, hash, key, key_len);
+        struct topk_entry *e;
+        int idx, evict;
+
+        tk->total += weight;
+
+        if (tk->table[slot]) {
+                e = &tk->entries[tk->table[slot] - 1];
+                e->count += weight;
+                e->error += error;
+                topk_sift_down(tk, e->heap_idx);
+                return;
+        }
+
+        if (tk->cnt < tk->size) {
+                /* Free counter, added as the heap's last leaf */
+                idx = tk->cnt;
+                e = &tk->entries[idx];
+                e->count = weight;
+                e->error = error;
+                e->heap_idx = tk->cnt;
+                tk->heap[tk->cnt++] = idx;
+                evict = 0;
+
+        } else {
+                /* Take over the smallest counter, the heap's root */
+                idx = tk->heap[0];
+                e = &tk->entries[idx];
+                topk_table_del(tk, topk_table_find(tk, e->hash, e->key,
+                                                   e->key_len));
+                slot = topk_table_find(tk, hash, key, key_len);
+                e->error = e->count + error;
+                e->count += weight;
+                evict = 1;
+        }
+
+        e->hash = hash;
+        e->key_len = key_len;
+        if (key_len > 0)
+                memcpy(e->key, key, key_len < KC_TOPK_KEY_MAX ?
+                       (size_t)key_len : KC_TOPK_KEY_MAX);
+        tk->table[slot] = idx + 1;
+
+        if (evict)
+                topk_sift_down(tk, e->heap_idx);
+        else
+                topk_sift_up(tk, e->heap_idx);
+}
+
+/**
+ * Add the counters of 'src' to 'dst'.
+ */
+static void topk_merge (struct topk *dst, const struct topk *src) {
+        int i;
+
+        for (i = 0 ; i < src->cnt ; i++) {
+                const struct topk_entry *e = &src->entries[i];
+                topk_add(dst, e->hash, e->key, e->key_len,
+                         e->count, e->error);
+        }
+
+        /* Weights of evicted keys */
+        dst->total += src->total;
+        for (i = 0 ; i < src->cnt ; i++)
+                dst->total -= src->entries[i].count;
+}
+
+
+static int topk_entry_cmp (const void *_a, const void *_b) {
+        const struct topk_entry *a = _a, *b = _b;
+
+        if (a->count != b->count)
+                return a->count < b->count ? 1 : -1;
+        return 0;
+}
+
+/**
+ * Set 'list' to the top keys of 'tk', most frequent first.
+ * The keys are copied since 'tk' may change once its lock is released.
+ */
+static void topk_list (const struct topk *tk, struct topkeys_list *list,
+                       int32_t partition, const char *what) {
+        struct topk_entry *all;
+
+        all = malloc(sizeof(*all) * (tk->cnt + 1));
+        memcpy(all, tk->entries, sizeof(*all) * tk->cnt);
+        qsort(all, tk->cnt, sizeof(*all), topk_entry_cmp);
+
+        list->partition = partition;
+        list->what      = what;
+        list->total     = tk->total;
+        list->cnt       = tk->cnt < topkeys.n ? tk->cnt : topkeys.n;
+        list->keys      = all;
+}
+
+
+
+/**
+ * Set up top keys tracking of the 'n' top keys for the topic's
+ * 'part_cnt' partitions, of which the 'cnt' partitions in 'partitions'
+ * are consumed.
+ * With an 'interval' the top keys are printed to 'fp' every
+ * 'interval' seconds, and always on exit.
+ */
+void topkeys_init (int n, int interval, FILE *fp,
+                   int part_cnt, const int32_t *partitions, int cnt) {
+        int cap = n * KC_TOPK_CAP_FACTOR;
+        int i;
+
+        if (cap < KC_TOPK_CAP_MIN)
+                cap = KC_TOPK_CAP_MIN;
+
+        topkeys.n        = n;
+        topkeys.interval = interval;
+        topkeys.fp       = fp;
+        topkeys.part_cnt = part_cnt;
+        topkeys.parts    = calloc(part_cnt, sizeof(*topkeys.parts));
+
+        for (i = 0 ; i < cnt ; i++) {
+                struct topkeys_part *tp = &topkeys.parts[partitions[i]];
+
+                pthread_mutex_init(&tp->lock, NULL);
+                tp->consumed = 1;
+                topk_init(&tp->msgs, cap);
+                topk_init(&tp->bytes, cap);
+        }
+
+        if (interval)
+                topkeys.next_report = time(NULL) + interval;
+}
+
+
+/**
+ * Count consumed message 'rkmessage'.
+ */
+void topkeys_msg (const rd_kafka_message_t *rkmessage) {
+        struct topkeys_part *tp = &topkeys.parts[rkmessage->partition];
+        ssize_t key_len = rkmessage->key ? (ssize_t)rkmessage->key_len : -1;
+        uint64_t hash = rkmessage->key ?
+                kc_hash64(rkmessage->key, rkmessage->key_len) : 0;
+
+        if (topkeys.interval)
+                pthread_mutex_lock(&tp->lock);
+
+        topk_add(&tp->msgs, hash, rkmessage->key, key_len, 1, 0);
+        topk_add(&tp->bytes, hash, rkmessage->key, key_len,
+                 rkmessage->key_len + rkmessage->len, 0);
+
+        if (topkeys.interval)
+                pthread_mutex_unlock(&tp->lock);
+}
+
+
+
+static void topkeys_print_key (FILE *fp, const struct topk_entry *e) {
+        ssize_t i, len;
+
+        if (e->key_len == -1) {
+                fprintf(fp, "%s", conf.null_str);
+                return;
+        }
+
+        len = e->key_len < KC_TOPK_KEY_MAX ? e->key_len : KC_TOPK_KEY_MAX;
+        for (i = 0 ; i < len ; i++) {
+                unsigned char c = e->key[i];
+
+                if (isprint(c) && c != '\\')
+                        fputc(c, fp);
+                else
+                        fprintf(fp, "\\x%02x", c);
+        }
+
+        if (e->key_len > KC_TOPK_KEY_MAX)
+                fprintf(fp, "... (%zd bytes)", e->key_len);
+}
+
+static void topkeys_print_table (FILE *fp, const struct topkeys_list *lists,
+                                 int cnt) {
+        int i, j;
+
+        for (i = 0 ; i < cnt ; i++) {
+                const struct topkeys_list *list = &lists[i];
+                char where[32];
+
+                if (list->partition == -1)
+                        snprintf(where, sizeof(where), "all partitions");
+                else
+                        snprintf(where, sizeof(where), "partition %"PRId32,
+                                 list->partition);
+
+                fprintf(fp, "# Top %i keys by %s, %s "
+                        "(%"PRIu64" %s)\n",
+                        topkeys.n, list->what, where,
+                        list->total, list->what);
+                fprintf(fp, "%14s %14s  %s\n", "Count", "Error", "Key");
+                for (j = 0 ; j < list->cnt ; j++) {
+                        fprintf(fp, "%14"PRIu64" %14"PRIu64"  ",
+                                list->keys[j].count, list->keys[j].error);
+                        topkeys_print_key(fp, &list->keys[j]);
+                        fputc('\n', fp);
+                }
+                fputc('\n', fp);
+        }
+}
+
+
+/**
+ * Print the top keys by messages and bytes of the topic and of each
+ * partition, as JSON with -J.
+ */
+void topkeys_print (void) {
+        struct topkeys_list *lists;
+        struct topk msgs, bytes;
+        int i, cap = 0, cnt = 0;
+
+        lists = malloc(sizeof(*lists) * (topkeys.part_cnt + 1) * 2);
+
+        /* Merge the partitions' counters, large enough to never evict */
+        for (i = 0 ; i < topkeys.part_cnt ; i++)
+                if (topkeys.parts[i].consumed)
+                        cap += topkeys.parts[i].msgs.size;
+
+        topk_init(&msgs, cap);
+        topk_init(&bytes, cap);
+
+        /* Leave room for the topic's lists first */
+        cnt = 2;
+
+        for (i = 0 ; i < topkeys.part_cnt ; i++) {
+                struct topkeys_part *tp = &topkeys.parts[i];
+
+                if (!tp->consumed)
+                        continue;
+
+                if (topkeys.interval)
+                        pthread_mutex_lock(&tp->lock);
+
+                topk_merge(&msgs, &tp->msgs);
+                topk_merge(&bytes, &tp->bytes);
+                topk_list(&tp->msgs, &lists[cnt++], i, "messages");
+                topk_list(&tp->bytes, &lists[cnt++], i, "bytes");
+
+                if (topkeys.interval)
+                        pthread_mutex_unlock(&tp->lock);
+        }
+
+        topk_list(&msgs, &lists[0], -1, "messages");
+        topk_list(&bytes, &lists[1], -1, "bytes");
+
+#if ENABLE_JSON
+        if (conf.flags & CONF_F_FMT_JSON)
+                topkeys_print_json(topkeys.fp, lists, cnt);
+        else
+#endif
+                topkeys_print_table(topkeys.fp, lists, cnt);
+
+        fflush(topkeys.fp);
+
+        for (i = 0 ; i < cnt ; i++)
+                free(lists[i].keys);
+        free(lists);
+
+        topk_destroy(&msgs);
+        topk_destroy(&bytes);
+}
+
+
+/**
+ * Print the top keys if the report interval has passed.
+ */
+void topkeys_tick (void) {
+        time_t now;
+
+        if (!topkeys.interval || (now = time(NULL)) < topkeys.next_report)
+                return;
+
+        topkeys_print();
+        topkeys.next_report = now + topkeys.interval;
+}
+
+
+void topkeys_term (void) {
+        int i;
+
+        for (i = 0 ; i < topkeys.part_cnt ; i++) {
+                struct topkeys_part *tp = &topkeys.parts[i];
+
+                if (!tp->consumed)
+                        continue;
+
+                topk_destroy(&tp->msgs);
+                topk_destroy(&tp->bytes);
+                pthread_mutex_destroy(&tp->lock);
+        }
+
+        free(topkeys.parts);
+        memset(&topkeys, 0, sizeof(topkeys));
+}